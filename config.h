@@ -0,0 +1,5 @@
+#define PACKAGE "vzlogger"
+#define VERSION "0.3.3"
+#define PACKAGE_STRING "vzlogger 0.3.3"
+#define PACKAGE_BUGREPORT "x"
+#define LOCAL_SUPPORT
@@ -0,0 +1,115 @@
+/**
+ * Running aggregates over the most recent readings
+ *
+ * Every reading is stored with the running sum and integral of all
+ * readings before it, so the aggregates of any suffix of the readings
+ * are a difference of two entries. Minimum and maximum are kept in
+ * monotonic deques which hold the candidates for all suffixes.
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _AGGREGATE_H_
+#define _AGGREGATE_H_
+
+#include <pthread.h>
+
+#include "reading.h"
+
+typedef enum {
+	AGGREGATE_COUNT,
+	AGGREGATE_SUM,
+	AGGREGATE_MEAN,
+	AGGREGATE_MIN,
+	AGGREGATE_MAX,
+	AGGREGATE_LAST,
+	AGGREGATE_INTEGRAL,	/* e.g. energy in Wh of power readings in W */
+	AGGREGATE_TYPES
+} aggregate_type_t;
+
+typedef struct {
+	long long time;		/* in milliseconds */
+	double value;
+	double sum;		/* of all readings before this one */
+	double integral;	/* of all readings up to this one, in value * hours */
+} aggregate_entry_t;
+
+/**
+ * Monotonic deque of sequence numbers
+ *
+ * Positions only grow, the slots are taken modulo the size of the aggregate.
+ */
+typedef struct {
+	unsigned long *seqs;
+	unsigned long head, tail;	/* positions of the oldest entry and after the newest */
+} aggregate_deque_t;
+
+typedef struct {
+	pthread_mutex_t mutex;
+
+	aggregate_entry_t *entries;	/* ring of the most recent readings by sequence number */
+	size_t size;			/* power of two; 0 until reserved */
+	unsigned long count;		/* number of readings added */
+	unsigned long base;		/* oldest reading which has been kept when the ring grew */
+
+	aggregate_deque_t min;		/* values are increasing from head to tail */
+	aggregate_deque_t max;		/* values are decreasing from head to tail */
+} aggregate_t;
+
+/* prototypes */
+void aggregate_init(aggregate_t *agg);
+void aggregate_free(aggregate_t *agg);
+
+/**
+ * Grow the ring to hold at least n readings
+ *
+ * Readings are not aggregated before the first call.
+ */
+int aggregate_reserve(aggregate_t *agg, size_t n);
+
+/**
+ * Add a reading
+ *
+ * Readings are expected to arrive in chronological order.
+ */
+void aggregate_push(aggregate_t *agg, reading_t *rd);
+
+/**
+ * Get the aggregates of all readings in the ring not older than since
+ *
+ * The readings are found by binary search, the aggregates in constant time.
+ *
+ * @param since in milliseconds
+ * @param values indexed by aggregate_type_t; without readings count, sum and integral are 0, the others NAN
+ */
+void aggregate_query(aggregate_t *agg, long long since, double values[AGGREGATE_TYPES]);
+
+/**
+ * Parse a comma separated list of aggregate types
+ *
+ * @return bitmask of (1 << type), 0 if invalid
+ */
+int aggregate_parse(const char *str);
+
+const char * aggregate_name(aggregate_type_t type);
+
+#endif /* _AGGREGATE_H_ */
@@ -29,44 +29,139 @@
 #include <stddef.h>
 #include <curl/curl.h>
 #include <json/json.h>
+#include <zlib.h>
 #include <sys/time.h>
 
 #include "buffer.h"
 #include "channel.h"
 
+#define API_CHUNK_SIZE 64 /* number of readings copied at once out of the buffer */
+#define API_SPOOL_CHUNK_SIZE 1024 /* maximum number of readings drained at once from the spool */
+#define API_TUPLE_LENGTH 60 /* maximum length of an encoded tuple: '[' + timestamp + ',' + value + ']' + ',' */
+#define API_CBOR_TUPLE_LENGTH 19 /* maximum length of a CBOR encoded tuple: array head + int64 + double */
+#define API_CBOR_INDEFINITE ((size_t) -1) /* length of arrays which are closed by api_cbor_break() */
+
+/**
+ * Growing byte buffer for streamed JSON encoding
+ */
 typedef struct {
-	char *data;
-	size_t size;
-} CURLresponse;
+	char *data;	/* always null terminated */
+	size_t size;	/* in bytes; allocated */
+	size_t length;	/* in bytes; used, without terminating null */
+} api_buffer_t;
 
+/**
+ * Upload context
+ *
+ * URL, headers and static CURL options are set up once,
+ * all buffers are reused for subsequent requests.
+ */
 typedef struct {
 	CURL *curl;
-	struct curl_slist *headers;
+	char *url;
+	struct curl_slist *headers;	/* currently passed to CURL; shared by all handles */
+
+	api_buffer_t body;	/* reused for all requests */
+	api_buffer_t compressed;
+	api_buffer_t response;	/* reused for all responses */
+
+	z_stream zstream;	/* reused for all requests */
+	int zstream_init;
+
+	unsigned long long bytes_raw;	/* total size of request bodies */
+	unsigned long long bytes_sent;	/* total size of request bodies after compression */
 } api_handle_t;
 
-int api_init(channel_t *ch, api_handle_t *api);
+/**
+ * Prepare handle for the channels URL: <middleware>/data/<uuid>.json
+ */
+int api_init(channel_t *ch, const char *middleware, api_handle_t *api);
+
+/**
+ * Prepare handle for coalesced requests of multiple channels: <middleware>/data.json
+ */
+int api_init_middleware(const char *middleware, api_handle_t *api);
+
+/**
+ * @param url gets freed by api_free(), or right away on error
+ * @param id prefix for debugging output
+ */
+int api_init_url(api_handle_t *api, char *url, void *id);
 void api_free(api_handle_t *api);
 
+/**
+ * Pass request body to CURL
+ *
+ * The body gets gzip compressed if enabled and larger than the threshold.
+ */
+void api_prepare(api_handle_t *api, void *id);
+
 /**
  * Reformat CURLs debugging output
  */
 int curl_custom_debug_callback(CURL *curl, curl_infotype type, char *data, size_t size, void *custom);
 
+/**
+ * Append CURLs response to an api_buffer_t
+ */
 size_t curl_custom_write_callback(void *ptr, size_t size, size_t nmemb, void *data);
 
+void api_buffer_init(api_buffer_t *b);
+void api_buffer_free(api_buffer_t *b);
+void api_buffer_clear(api_buffer_t *b);
+void api_buffer_reserve(api_buffer_t *b, size_t n);
+void api_buffer_append(api_buffer_t *b, const char *str, size_t len);
+
+/**
+ * Append JSON encoded values
+ *
+ * Doubles are encoded with up to 6 decimal places, like json-c does.
+ */
+void api_json_string(api_buffer_t *b, const char *str);
+void api_json_double(api_buffer_t *b, double value);
+void api_json_int(api_buffer_t *b, long long value);
+
+/**
+ * Append JSON array of tuples
+ *
+ * Timestamps are encoded as integer milliseconds.
+ *
+ * @param buf	the buffer our readings are stored in
+ * @param from	the sequence number of the first tuple which should be encoded
+ * @param to	the sequence number after the last tuple which should be encoded
+ * @param max	stop encoding once the JSON buffer has reached this length; it is exceeded by one tuple at most
+ * @return the sequence number after the last encoded tuple
+ */
+unsigned long api_json_tuples(api_buffer_t *b, buffer_t *buf, unsigned long from, unsigned long to, size_t max);
+
+/**
+ * Append JSON array of tuples from an array of readings
+ */
+void api_json_readings(api_buffer_t *b, reading_t *rds, size_t n);
+
+/**
+ * Append CBOR (RFC 8949) encoded values
+ *
+ * Integers use the shortest head, doubles are always encoded as 64 bit IEEE 754.
+ */
+void api_cbor_map(api_buffer_t *b, size_t n);
+void api_cbor_array(api_buffer_t *b, size_t n);
+void api_cbor_break(api_buffer_t *b);
+void api_cbor_string(api_buffer_t *b, const char *str);
+void api_cbor_double(api_buffer_t *b, double value);
+void api_cbor_int(api_buffer_t *b, long long value);
+
 /**
- * Create JSON object of tuples
+ * Append CBOR array of tuples: [[timestamp, value], ...]
  *
- * @param buf	the buffer our readings are stored in (required for mutex)
- * @param first	the first tuple of our linked list which should be encoded
- * @param last	the last tuple of our linked list which should be encoded
- * @return the json_object (has to be free'd)
+ * Timestamps are encoded as integer milliseconds.
+ * The parameters are the same as for api_json_tuples().
  */
-json_object * api_json_tuples(buffer_t *buf, reading_t *first, reading_t *last);
+unsigned long api_cbor_tuples(api_buffer_t *b, buffer_t *buf, unsigned long from, unsigned long to, size_t max);
 
 /**
  * Parses JSON encoded exception and stores describtion in err
  */
-int api_parse_exception(CURLresponse response, char *err, size_t n);
+int api_parse_exception(api_buffer_t *response, char *err, size_t n);
 
 #endif /* _API_H_ */
@@ -0,0 +1,82 @@
+/**
+ * Compressed blocks of readings
+ *
+ * Timestamps are stored as delta-of-delta in milliseconds and values
+ * XOR-encoded against their predecessor (see Facebook's Gorilla paper).
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BLOCK_H_
+#define _BLOCK_H_
+
+#include <stdint.h>
+
+#include "reading.h"
+
+#define BLOCK_SIZE 256 /* in bytes, including header */
+
+typedef struct {
+	unsigned long seq;	/* sequence number of the first reading */
+	unsigned int count;	/* number of readings in block */
+	unsigned char data[BLOCK_SIZE - sizeof(unsigned long) - sizeof(unsigned int)];
+} block_t;
+
+/**
+ * State shared between encoder and decoder
+ */
+typedef struct {
+	block_t *block;
+	size_t pos;		/* in bits */
+
+	int64_t time;		/* previous timestamp in milliseconds */
+	int64_t delta;		/* previous difference of timestamps */
+	uint64_t value;		/* previous value as raw bits */
+	int leading, trailing;	/* number of zeros around the previous XOR'ed value */
+} block_coder_t;
+
+/* prototypes */
+
+/**
+ * Start a new block
+ */
+void block_encoder_init(block_coder_t *enc, block_t *block, unsigned long seq);
+
+/**
+ * Append a reading to the block
+ *
+ * Timestamps are truncated to milliseconds.
+ *
+ * @return 0 on success, <0 if the block is full
+ */
+int block_encode(block_coder_t *enc, const reading_t *rd);
+
+void block_decoder_init(block_coder_t *dec, block_t *block);
+
+/**
+ * Decode next reading
+ *
+ * Has to be called at most block->count times.
+ */
+void block_decode(block_coder_t *dec, reading_t *rd);
+
+#endif /* _BLOCK_H_ */
@@ -1,5 +1,5 @@
 /**
- * Circular buffer (double linked, threadsafe)
+ * Circular buffer (array based ring, threadsafe)
  *
  * Used to store recent readings and buffer in case of net inconnectivity
  *
@@ -28,30 +28,218 @@
 #ifndef _BUFFER_H_
 #define _BUFFER_H_
 
+#include <stdint.h>
 #include <pthread.h>
 #include <sys/time.h>
 
 #include "meter.h"
+#include "block.h"
 
+/**
+ * Memory of the ring
+ *
+ * Replaced rings are retired but not free'd before buffer_free()
+ * because lock-free readers might still access them.
+ */
+typedef struct buffer_ring {
+	struct buffer_ring *retired;	/* previous ring */
+	size_t capacity;		/* always a power of two */
+	reading_t readings[];
+} buffer_ring_t;
+
+/**
+ * Compact representation of readings in the spill tier
+ */
 typedef struct {
-	reading_t *tail;
-	reading_t *head;
-	reading_t *sent;
+	int64_t time;	/* timestamp in microseconds */
+	double value;
+} buffer_spilled_t;
 
-	int size;	/* number of readings currently in the buffer */
-	int keep;	/* number of readings to cache for local interface */
+/**
+ * Memory mapped region holding readings which have been pushed out of the ring
+ *
+ * Readings are either stored as fixed size records, addressed like the ring,
+ * or in compressed blocks, which are stored in a ring of blocks by themselves.
+ */
+typedef struct {
+	int compressed;
+	size_t capacity;	/* number of records/blocks; always a power of two */
 
+	union {
+		buffer_spilled_t *readings;
+		block_t *blocks;
+	};
+
+	unsigned long block_head;	/* index of the oldest block */
+	unsigned long block_tail;	/* index of the next block to be written */
+} buffer_spill_t;
+
+#define BUFFER_CURSORS_MAX 8 /* maximum number of consumers per buffer */
+
+/**
+ * Position of a consumer in the buffer
+ *
+ * Holding cursors prevent unconsumed readings from being dropped.
+ */
+typedef struct {
+	unsigned long seq;	/* sequence number of the next reading to consume */
+	int hold;
+
+	int waiting;	/* number of threads blocked in buffer_wait() or buffer_poll() */
+	int fd;		/* notifies event-driven consumer about new readings, -1 if unused */
 	pthread_mutex_t mutex;
+	pthread_cond_t condition;	/* notifies blocking consumer about new readings */
+} buffer_cursor_t;
+
+/**
+ * Readings are addressed by continuously increasing sequence numbers.
+ * The position in the ring is the sequence number modulo the capacity.
+ *
+ * The buffer is a lock-free single-producer/multi-consumer queue:
+ * - head and tail are only written by the producer (reading_thread)
+ * - each cursor is only written by its consumer (logging_thread, local interface)
+ * Cursors have to be registered before the producer starts.
+ * The mutexes are only required to block idle threads in buffer_wait().
+ *
+ * Readings which have to make room in a full ring are moved to the spill tier
+ * if available, as long as they are not consumed by all holding cursors or part
+ * of the history window for the local interface.
+ * The spill tier holds the readings [spill_head, head).
+ */
+typedef struct {
+	buffer_ring_t *ring;
+	buffer_spill_t *spill;
+
+	unsigned long spill_head;	/* sequence number of the oldest spilled reading */
+	unsigned long head;	/* sequence number of the oldest reading in the ring */
+	unsigned long tail;	/* sequence number of the next reading to be pushed */
+
+	buffer_cursor_t cursors[BUFFER_CURSORS_MAX];
+	int ncursors;
+
+	int keep;	/* number of readings to cache for local interface */
+	size_t budget;	/* in bytes; maximum size of the ring, 0 for unlimited */
+
+	unsigned long spilled;	/* number of readings moved to the spill tier */
+	unsigned long overwritten;	/* number of unconsumed readings lost due to a full ring/spill */
 } buffer_t;
 
 /* prototypes */
 void buffer_init(buffer_t *buf);
-reading_t * buffer_push(buffer_t *buf, reading_t *rd);
 void buffer_free(buffer_t *buf);
-void buffer_clean(buffer_t *buf);
 void buffer_clear(buffer_t *buf);
+
+/**
+ * Continue numbering of readings at seq
+ *
+ * Only allowed before the first reading has been pushed.
+ */
+void buffer_seek(buffer_t *buf, unsigned long seq);
+
+/**
+ * Register a consumer
+ *
+ * The cursor starts at the tail of the buffer.
+ *
+ * @param hold retain readings until they have been consumed
+ * @return the cursor, NULL if there are too many consumers
+ */
+buffer_cursor_t * buffer_cursor(buffer_t *buf, int hold);
+
+/**
+ * Enable spill tier
+ *
+ * The file is unlinked after mapping it, so it vanishes on exit.
+ *
+ * @param path the file which will be created and mapped, NULL for anonymous memory
+ * @param size in bytes; the size of the mapping
+ * @param compressed store readings in compressed blocks
+ * @return 0 on success, <0 on error
+ */
+int buffer_spill(buffer_t *buf, const char *path, size_t size, int compressed);
+
+/* producer functions */
+int buffer_reserve(buffer_t *buf, size_t n);
+reading_t * buffer_push(buffer_t *buf, reading_t *rd);
+void buffer_clean(buffer_t *buf);
+void buffer_notify(buffer_t *buf);
 char * buffer_dump(buffer_t *buf, char *dump, size_t len);
 
+/* consumer functions */
+
+/**
+ * Copy readings out of the buffer
+ *
+ * Readings which have been overwritten in the meantime are skipped.
+ * Spilled readings are read back from the spill tier.
+ *
+ * @param from	the sequence number of the first reading to copy,
+ *		gets updated to the sequence number of the first copied reading
+ * @param to	the sequence number after the last reading to copy
+ * @param rds	the array to store the readings to
+ * @param n	the size of the array
+ * @return the number of copied readings
+ */
+size_t buffer_read(buffer_t *buf, unsigned long *from, unsigned long to, reading_t *rds, size_t n);
+
+/**
+ * Find the first reading which is newer than a timestamp
+ *
+ * Readings are expected in chronological order, so we can use a binary search.
+ * This works across the ring and the spill tier.
+ *
+ * @param from	the sequence number of the first reading to search
+ * @param to	the sequence number after the last reading to search
+ * @return the sequence number of the first reading newer than tv, to if there is none
+ */
+unsigned long buffer_search(buffer_t *buf, unsigned long from, unsigned long to, struct timeval tv);
+
+/**
+ * Mark readings before seq as consumed
+ */
+void buffer_advance(buffer_cursor_t *cur, unsigned long seq);
+
+/**
+ * Block until a reading with sequence number seq has been pushed
+ *
+ * @param cur the cursor to be woken up by buffer_notify()
+ * @param abstime optional timeout
+ * @return 0 on success, <0 on timeout
+ */
+int buffer_wait(buffer_t *buf, buffer_cursor_t *cur, unsigned long seq, const struct timespec *abstime);
+
+/**
+ * Arm notification of an event-driven consumer
+ *
+ * If no readings are pending, buffer_notify() writes a byte to cur->fd
+ * as soon as a new reading has been pushed.
+ *
+ * @return TRUE if readings are pending, FALSE if the consumer may go to sleep
+ */
+int buffer_poll(buffer_t *buf, buffer_cursor_t *cur);
+
+/**
+ * Get reading by its sequence number
+ *
+ * Only safe for the producer! The sequence number has to be in the range [head, tail)
+ */
+static inline reading_t * buffer_get(buffer_t *buf, unsigned long seq) {
+	return &buf->ring->readings[seq & (buf->ring->capacity - 1)];
+}
+
+/**
+ * Number of readings currently in the buffer
+ */
+static inline size_t buffer_size(buffer_t *buf) {
+	return __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Sequence number of the next reading to be pushed
+ */
+static inline unsigned long buffer_tail(buffer_t *buf) {
+	return __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE);
+}
 
 #endif /* _BUFFER_H_ */
 
@@ -31,6 +31,21 @@
 #include "meter.h"
 #include "vzlogger.h"
 #include "buffer.h"
+#include "spool.h"
+#include "aggregate.h"
+
+#define CHANNEL_SINKS_MAX 4 /* maximum number of middlewares per channel */
+
+/**
+ * Middleware the readings of a channel are logged to
+ *
+ * Every sink consumes the buffer with its own cursor,
+ * so a slow sink does not delay the others.
+ */
+typedef struct {
+	char *middleware;		/* url to middleware */
+	buffer_cursor_t *cursor;	/* position of the logging thread in the buffer */
+} channel_sink_t;
 
 typedef struct channel {
 	char id[5];			/* only for internal usage & debugging */
@@ -38,16 +53,76 @@ typedef struct channel {
 	reading_id_t identifier;	/* channel identifier (OBIS, string) */
 	reading_t last;			/* most recent reading */
 	buffer_t buffer;		/* circular queue to buffer readings */
+	spool_t *spool;			/* persistent queue of unsent readings (optional) */
 
-	pthread_cond_t condition;	/* pthread syncronization to notify logging thread and local webserver */
-	pthread_t thread;		/* pthread for asynchronus logging */
+	channel_sink_t sinks[CHANNEL_SINKS_MAX];
+	size_t nsinks;
+	size_t batch_max_tuples;	/* flush after this number of pending readings */
+	int batch_max_delay;		/* in seconds; flush if the oldest pending reading is older */
+	buffer_cursor_t *local;		/* position of the local interface in the buffer */
+	unsigned long version;		/* bumped by the reading thread on new readings */
+	aggregate_t aggregate;		/* running aggregates for the local interface */
 
-	char *middleware;		/* url to middleware */
 	char *uuid;			/* unique identifier for middleware */
+	size_t index;			/* position in the channel index */
 } channel_t;
 
+/**
+ * Hash index of all channels by their UUID
+ *
+ * Open addressing with linear probing, the table is at most half full.
+ */
+typedef struct channel_index {
+	channel_t **table;	/* NULL for empty slots */
+	size_t size;		/* power of two */
+	size_t count;		/* number of indexed channels */
+} channel_index_t;
+
 /* prototypes */
-void channel_init(channel_t *ch, const char *uuid, const char *middleware, reading_id_t identifier);
+int channel_index_init(channel_index_t *idx, list_t *mappings);
+void channel_index_free(channel_index_t *idx);
+
+/**
+ * Find channel by its UUID
+ *
+ * @return the channel, NULL if there is none
+ */
+channel_t * channel_index_lookup(channel_index_t *idx, const char *uuid);
+
+void channel_init(channel_t *ch, const char *uuid, reading_id_t identifier);
 void channel_free(channel_t *ch);
 
+/**
+ * Add a middleware the readings are logged to
+ *
+ * @return 0 on success, <0 if there are too many sinks
+ */
+int channel_add_sink(channel_t *ch, const char *middleware);
+
+/**
+ * Mark readings as sent to a sink
+ *
+ * The spool is acknowledged up to the slowest sink.
+ *
+ * @param seq the sequence number after the last sent reading
+ */
+void channel_ack(channel_t *ch, channel_sink_t *sink, unsigned long seq);
+
+/**
+ * Enable spill tier of buffer
+ *
+ * @param path the directory for the spill file; the file is named by the channels UUID
+ *	NULL for anonymous memory
+ * @return 0 on success, <0 on error
+ */
+int channel_spill(channel_t *ch, const char *path, size_t size, int compressed);
+
+/**
+ * Enable persistent spool and replay unsent readings
+ *
+ * @param path the spool directory; each channel uses a subdirectory named by its UUID
+ * @return 0 on success, <0 on error
+ */
+int channel_spool(channel_t *ch, const char *path, size_t max, int sync);
+
 #endif /* _CHANNEL_H_ */
@@ -41,10 +41,34 @@ typedef struct {
 	FILE *logfd;
 
 	int port;		/* TCP port for local interface */
+	int local_threads;	/* size of the thread pool of the local interface */
 	int verbosity;		/* verbosity level */
 	int comet_timeout;	/* in seconds;  */
 	int buffer_length;	/* in seconds; how long to buffer readings for local interfalce */
 	int retry_pause;	/* in seconds; how long to pause after an unsuccessful HTTP request */
+	int retry_max;		/* in seconds; upper limit of the exponential backoff if the middleware is unavailable */
+	int connections;	/* maximum number of concurrent connections per middleware host */
+	int batch_max_tuples;	/* default for channels; flush after this number of pending readings */
+	int batch_max_delay;	/* default for channels; in seconds; flush if the oldest pending reading is older */
+	int compress;		/* gzip compress request bodies */
+	int compress_level;	/* zlib compression level, 1 (fastest) to 9 (best) */
+	size_t compress_threshold;	/* in bytes; minimum size of request bodies to compress */
+	size_t chunk_tuples;	/* maximum number of tuples per request */
+	size_t chunk_bytes;	/* in bytes; maximum size of a request body */
+	int coalesce;		/* coalesce readings of all channels of a middleware into a single request */
+	size_t coalesce_tuples;	/* maximum number of tuples per coalesced request */
+	int coalesce_delay;	/* in milliseconds; how long to wait for readings of other channels */
+	int buffer_headroom;	/* number of unsent readings to buffer per channel in case of net inconnectivity */
+
+	int memory_channel;	/* in bytes; maximum size of the buffer per channel, 0 for unlimited */
+	int memory_total;	/* in bytes; maximum size of all buffers, 0 for unlimited */
+	char *spill;		/* directory for spill files, NULL disables spilling */
+	int spill_size;		/* in bytes; size of spill file per channel */
+	int memory_compress;	/* store spilled readings in compressed blocks */
+
+	char *spool;		/* directory for persistent spool of unsent readings, NULL disables spooling */
+	int spool_max;		/* in bytes; maximum size of spool per channel */
+	int spool_sync;		/* in seconds; how often spooled readings are synced to disk */
 
 	/* boolean bitfields, padding at the end of struct */
 	int channel_index:1;	/* give a index of all available channels via local interface */
@@ -57,6 +81,7 @@ typedef struct {
 /* forward declarartions */
 struct map;
 struct channel;
+struct channel_index;
 
 /**
  * Reads key, value and type from JSON object
@@ -82,10 +107,11 @@ int config_validate_uuid(const char *uuid);
  *
  * @param const char *filename the path of the configuration file
  * @param list_t *mappings a pointer to a list, where new channel<->meter mappings should be stored
+ * @param channel_index_t *index gets (re)built to look up channels by their UUID
  * @param config_options_t *options a pointer to a structure of global configuration options
  * @return int non-zero on success
  */
-int config_parse(const char *filename, list_t *mappings, config_options_t *options);
+int config_parse(const char *filename, list_t *mappings, struct channel_index *index, config_options_t *options);
 
 struct channel * config_parse_channel(struct json_object *jso, meter_protocol_t protocol);
 struct map * config_parse_meter(struct json_object *jso);
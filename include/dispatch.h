@@ -0,0 +1,87 @@
+/**
+ * Routing of readings to the channels of a meter
+ *
+ * Channels are hashed by their identifier. OBIS patterns are grouped by
+ * their wildcards: within a group the wildcards are masked out of the
+ * packed identifier, so a reading is routed with one lookup per group.
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DISPATCH_H_
+#define _DISPATCH_H_
+
+#include <stdint.h>
+
+#include "meter.h"
+#include "reading.h"
+#include "list.h"
+
+struct channel; /* forward declaration */
+
+typedef struct {
+	unsigned long long key;
+	struct channel *ch;
+	int next;		/* index of the next entry in the same slot; -1 for none */
+} dispatch_entry_t;
+
+/**
+ * Hash table of channels with the same wildcards
+ */
+typedef struct {
+	uint64_t mask;			/* OBIS groups which are no wildcards, see obis_mask() */
+
+	int *slots;			/* index of the first entry; -1 for empty slots */
+	size_t size;			/* power of two */
+
+	dispatch_entry_t *entries;
+	size_t count;
+} dispatch_group_t;
+
+typedef struct dispatch {
+	meter_protocol_t protocol;
+	int all;			/* protocol without identifiers: every reading belongs to every channel */
+
+	dispatch_group_t *groups;
+	size_t ngroups;
+
+	struct channel **matches;	/* result of the last lookup */
+	struct channel **channels;	/* all channels of the meter */
+	size_t nchannels;
+} dispatch_t;
+
+/* prototypes */
+int dispatch_init(dispatch_t *d, meter_protocol_t protocol, list_t *channels);
+void dispatch_free(dispatch_t *d);
+
+/**
+ * Get the channels a reading belongs to
+ *
+ * Same result as comparing the identifier with every channel by reading_id_compare().
+ * Not thread-safe, the result is only valid until the next call.
+ *
+ * @param n the number of channels
+ * @return the channels
+ */
+struct channel ** dispatch_lookup(dispatch_t *d, reading_id_t id, size_t *n);
+
+#endif /* _DISPATCH_H_ */
@@ -29,9 +29,91 @@
 #include <stdint.h>	/* required for libMHD */
 #include <stdarg.h>	/* required for libMHD */
 #include <sys/socket.h>	/* required for libMHD */
+#include <pthread.h>
 
 #include <microhttpd.h>
 
+#include "list.h"
+#include "channel.h"
+#include "api.h"
+
+/**
+ * Gzip compressed response document
+ *
+ * Built by the first request accepting gzip after new readings have arrived,
+ * subsequent requests get a copy without compressing again.
+ */
+typedef struct {
+	pthread_mutex_t mutex;
+	api_buffer_t data;
+	unsigned long version;	/* of the compressed document, see local_version() */
+	int valid;
+} local_gzip_t;
+
+/**
+ * Pre-serialized JSON object of a channel
+ *
+ * The snapshot is tagged with the tail of the channels buffer.
+ * New readings advance the tail and thereby invalidate the snapshot,
+ * which is rebuilt by the next request.
+ */
+typedef struct {
+	channel_t *ch;
+	map_t *mapping;
+
+	pthread_mutex_t mutex;
+	api_buffer_t json;
+	unsigned long tail;	/* sequence number after the last reading in the snapshot */
+	int valid;
+
+	local_gzip_t gzip;	/* of the response for this channel */
+} local_channel_t;
+
+/**
+ * Comet request or event stream which is suspended until new readings arrive
+ */
+typedef struct local_request {
+	struct local *local;
+	struct MHD_Connection *connection;
+	local_channel_t *channel;	/* NULL for all channels */
+	unsigned long *tails;		/* comet: of the requested channels at the time of the request
+					   stream: sequence numbers of the next readings to send */
+	long long deadline;		/* in milliseconds; comet timeout or next keepalive of a stream */
+
+	int stream;			/* server-sent events instead of a single response */
+	api_buffer_t events;		/* encoded events which have not been passed to libmicrohttpd yet */
+	size_t offset;
+
+	struct local_request *next;
+} local_request_t;
+
+typedef struct local {
+	struct MHD_Daemon *httpd;
+	channel_index_t *index;	/* to look up channels by UUID */
+
+	local_channel_t *channels;	/* in the order of the channel index */
+	size_t count;
+	local_gzip_t gzip;		/* of the response for all channels */
+	long long epoch;		/* start time in milliseconds; distinguishes ETags of different runs */
+
+	pthread_t thread;	/* resumes suspended comet requests */
+	int notify[2];		/* pipe to wake up the thread on new readings */
+	pthread_mutex_t mutex;	/* protects the list of suspended requests */
+	local_request_t *suspended;
+
+	volatile int shutdown;
+} local_t;
+
+/**
+ * Start the HTTPd for the local interface
+ */
+int local_init(local_t *local, list_t *mappings, channel_index_t *index);
+
+/**
+ * Resume suspended requests and stop the HTTPd
+ */
+void local_free(local_t *local);
+
 int handle_request(
 	void *cls,
 	struct MHD_Connection *connection,
@@ -44,5 +126,3 @@ int handle_request(
 );
 
 #endif /* _LOCAL_H_ */
-
-
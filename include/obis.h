@@ -27,9 +27,17 @@
 #define _OBIS_H_
 
 #include <string.h>
+#include <stdint.h>
 
 #define OBIS_STR_LEN (6*3+5+1)
 
+/* bytes of the packed representation which hold the six groups */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define OBIS_PACKED_MASK 0xffffffffffff0000ULL
+#else
+#define OBIS_PACKED_MASK 0x0000ffffffffffffULL
+#endif
+
 /* regex: A-BB:CC.DD.EE([*&]FF)? */
 typedef union {
 	unsigned char raw[6];
@@ -37,6 +45,7 @@ typedef union {
 		unsigned char media, channel, indicator, mode, quantities;
 		unsigned char storage;	/* not used in Germany */
 	} groups;
+	uint64_t packed;	/* all groups at once; the two remaining bytes are zero */
 } obis_id_t;
 
 typedef struct {
@@ -54,6 +63,13 @@ int obis_lookup_alias(const char *alias, obis_id_t *id);
 int obis_unparse(obis_id_t id, char *buffer, size_t n);
 int obis_compare(obis_id_t a, obis_id_t b);
 
+/**
+ * Get the mask of the groups which are no wildcards (0xff)
+ *
+ * Two identifiers match if ((a.packed ^ b.packed) & obis_mask(a) & obis_mask(b)) == 0.
+ */
+uint64_t obis_mask(obis_id_t id);
+
 int obis_is_manufacturer_specific(obis_id_t id);
 int obis_is_null(obis_id_t id);
 
@@ -43,8 +43,6 @@ typedef struct reading {
 	double value;
 	struct timeval time;
 	reading_id_t identifier;
-
-	struct reading *next; /* pointer for linked list */
 } reading_t;
 
 /* prototypes */
@@ -0,0 +1,122 @@
+/**
+ * Persistent write-ahead spool for unsent readings
+ *
+ * Every reading of a channel is appended to segmented files on disk.
+ * Readings which are not acknowledged by the middleware survive restarts
+ * and can be drained even if they have already been overwritten in the buffer.
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "reading.h"
+
+#define SPOOL_SEGMENT_RECORDS 32768 /* number of records per segment file (1 MiB) */
+#define SPOOL_PENDING 64 /* number of records written at once */
+#define SPOOL_RETRY 10 /* in seconds; delay before starting a new segment after a failure */
+
+/**
+ * Record as stored on disk
+ */
+typedef struct {
+	uint32_t crc;		/* CRC-32 of all following fields */
+	uint32_t reserved;
+	uint64_t seq;		/* sequence number in the channel buffer */
+	int64_t time;		/* timestamp in microseconds */
+	double value;
+} spool_record_t;
+
+typedef struct {
+	char *path;		/* directory containing the segments */
+	int fd;			/* segment we are currently appending to */
+	int dirfd;
+	int ackfd;		/* file containing the acknowledged sequence number */
+
+	unsigned long *segments;	/* sequence numbers of the first record in each segment */
+	size_t count;		/* number of segments */
+	size_t records;		/* number of records in the last segment */
+
+	spool_record_t buffer[SPOOL_PENDING];	/* records not yet written to the segment */
+	size_t pending;
+
+	unsigned long next;	/* sequence number of the next record to be appended */
+	unsigned long acked;	/* sequence number of the first unacknowledged record */
+	time_t failed;		/* time of the last failure to start a segment; 0 if none */
+
+	size_t max;		/* maximum size of all segments in bytes */
+	int sync;		/* in seconds; interval between calls to fsync() */
+	time_t synced;		/* time of last fsync() */
+
+	pthread_mutex_t mutex;
+} spool_t;
+
+/**
+ * Open spool and replay existing segments
+ *
+ * @param spool the spool structure to initialize
+ * @param path the directory for the segments; will be created if necessary
+ * @param max maximum size of all segments in bytes
+ * @param sync interval between calls to fsync() in seconds
+ * @return 0 on success, <0 on error
+ */
+int spool_open(spool_t *spool, const char *path, size_t max, int sync);
+void spool_close(spool_t *spool);
+
+/**
+ * Append reading to the spool
+ *
+ * Records are written in order and have to use increasing sequence numbers.
+ * Missing sequence numbers and readings which could not be written leave gaps.
+ */
+int spool_append(spool_t *spool, unsigned long seq, const reading_t *rd);
+
+/**
+ * Flush appended records and fsync() them if the sync interval elapsed
+ */
+int spool_sync(spool_t *spool);
+
+/**
+ * Read unacknowledged records from the spool
+ *
+ * Corrupted records are skipped.
+ *
+ * @param from	the sequence number of the first reading to read,
+ *		gets updated to the sequence number after the last read or skipped record
+ * @param to	the sequence number after the last reading to read
+ * @param rds	the array to store the readings to
+ * @param n	the size of the array
+ * @return the number of read readings
+ */
+size_t spool_read(spool_t *spool, unsigned long *from, unsigned long to, reading_t *rds, size_t n);
+
+/**
+ * Acknowledge all records before seq and remove obsolete segments
+ */
+int spool_ack(spool_t *spool, unsigned long seq);
+
+#endif /* _SPOOL_H_ */
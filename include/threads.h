@@ -26,8 +26,6 @@
 #ifndef _THREADS_H_
 #define _THREADS_H_
 
-void logging_thread_cleanup(void *arg);
-
 void * logging_thread(void *arg);
 void * reading_thread(void *arg);
 
@@ -0,0 +1,150 @@
+/**
+ * Event-driven upload of readings to the middleware
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UPLOAD_H_
+#define _UPLOAD_H_
+
+#include <time.h>
+#include <curl/curl.h>
+
+#include "api.h"
+#include "channel.h"
+#include "list.h"
+
+#define UPLOAD_SHUTDOWN_TIMEOUT 10 /* in seconds; how long to wait for the final flush */
+
+struct upload_middleware;
+
+/**
+ * Upload state of a single sink of a channel or of a coalesced request (ch == NULL)
+ */
+typedef struct {
+	channel_t *ch;
+	channel_sink_t *sink;
+	struct upload_middleware *middleware;
+
+	api_handle_t api;
+
+	int busy;		/* request is in flight */
+	unsigned long last;	/* sequence number after the last reading of the pending request */
+	time_t retry;		/* no new request before this time after a rejected one */
+	int rejected;		/* last single request has been rejected; excluded from coalesced requests */
+	long long pending;	/* in milliseconds; since when readings are pending, 0 if none */
+	int requests;		/* number of finished requests */
+} upload_t;
+
+/**
+ * Health of a middleware (circuit breaker)
+ *
+ * closed:	requests are sent as usual
+ * open:	middleware is unavailable, no requests until the backoff expires
+ * half-open:	a single probe request decides whether the backlog of all channels is released
+ */
+typedef enum {
+	UPLOAD_CLOSED,
+	UPLOAD_OPEN,
+	UPLOAD_HALF_OPEN
+} upload_circuit_t;
+
+/**
+ * Channels which are logging to the same middleware
+ *
+ * Their readings are coalesced into a single request. If the middleware
+ * rejects it, single requests are sent for a while to find the offending
+ * channels, which are left out of coalesced requests afterwards.
+ */
+typedef struct upload_middleware {
+	const char *url;
+	int coalesce;		/* coalesce requests of the channels */
+	time_t fallback;	/* single requests until this time after a rejected coalesced request */
+	long long pending;	/* in milliseconds; since when readings are waiting for a coalesced request, 0 if none */
+
+	upload_circuit_t circuit;
+	int failures;		/* number of consecutive failures */
+	long long retry;	/* in milliseconds; circuit stays open until this time */
+	upload_t *probe;	/* request probing the middleware in half-open state */
+
+	upload_t request;	/* coalesced request */
+
+	upload_t **channels;
+	size_t count;
+} upload_middleware_t;
+
+/**
+ * All uploads are multiplexed over a single curl multi handle.
+ * This shares the connection and DNS caches between channels
+ * which are logging to the same middleware.
+ */
+typedef struct {
+	CURLM *multi;
+	int notify[2];		/* pipe to wake up the engine on new readings */
+
+	upload_t *uploads;
+	size_t count;
+
+	upload_middleware_t *middlewares;
+	size_t nmiddlewares;
+
+	unsigned int seed;	/* for jitter of backoff */
+
+	volatile int shutdown;	/* flush all pending readings and stop */
+} upload_engine_t;
+
+int upload_init(upload_engine_t *engine, list_t *mappings);
+void upload_free(upload_engine_t *engine);
+
+/**
+ * Start requests for channels with pending readings
+ *
+ * @param timeout in milliseconds; gets lowered if a request has to be started earlier
+ * @return the number of started requests
+ */
+int upload_schedule(upload_engine_t *engine, int *timeout);
+
+/**
+ * Check response of a finished request and advance the channels cursors
+ */
+void upload_finish(upload_engine_t *engine, upload_t *up, CURLcode result);
+
+/**
+ * Request a final flush of all pending readings
+ *
+ * Async-signal-safe, can be called from a signal handler.
+ */
+void upload_shutdown(upload_engine_t *engine);
+
+/**
+ * Check if requests are in flight
+ */
+int upload_busy(upload_engine_t *engine);
+
+/**
+ * Wait for new readings, finished requests or timeout
+ *
+ * @param timeout in milliseconds
+ */
+void upload_wait(upload_engine_t *engine, int timeout);
+
+#endif /* _UPLOAD_H_ */
@@ -34,6 +34,7 @@
 #include "meter.h"
 #include "common.h"
 #include "list.h"
+#include "dispatch.h"
 
 /**
  * Type for mapping channels to meters
@@ -41,6 +42,7 @@
 typedef struct map {
 	meter_t meter;
 	list_t channels;
+	dispatch_t dispatch;	/* routes readings to channels */
 
 	pthread_t thread;
 } map_t;
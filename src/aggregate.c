@@ -0,0 +1,276 @@
+/**
+ * Running aggregates over the most recent readings
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "aggregate.h"
+#include "common.h"
+
+#define AGGREGATE_MIN_SIZE 16
+
+static const char *aggregate_names[] = {
+	"count", "sum", "mean", "min", "max", "last", "integral"
+};
+
+void aggregate_init(aggregate_t *agg) {
+	pthread_mutex_init(&agg->mutex, NULL);
+
+	agg->entries = NULL;
+	agg->size = 0;
+	agg->count = 0;
+	agg->base = 0;
+
+	memset(&agg->min, 0, sizeof(aggregate_deque_t));
+	memset(&agg->max, 0, sizeof(aggregate_deque_t));
+}
+
+void aggregate_free(aggregate_t *agg) {
+	free(agg->entries);
+	free(agg->min.seqs);
+	free(agg->max.seqs);
+
+	pthread_mutex_destroy(&agg->mutex);
+}
+
+/**
+ * Get the sequence number of the oldest reading in the ring
+ */
+static unsigned long aggregate_oldest(aggregate_t *agg) {
+	return (agg->count > agg->size + agg->base) ? agg->count - agg->size : agg->base;
+}
+
+int aggregate_reserve(aggregate_t *agg, size_t n) {
+	size_t size = (agg->size) ? agg->size : AGGREGATE_MIN_SIZE;
+
+	if (n <= agg->size) {
+		return SUCCESS;
+	}
+
+	while (size < n) {
+		size *= 2;
+	}
+
+	aggregate_entry_t *entries = malloc(size * sizeof(aggregate_entry_t));
+	unsigned long *min = malloc(size * sizeof(unsigned long));
+	unsigned long *max = malloc(size * sizeof(unsigned long));
+
+	if (entries == NULL || min == NULL || max == NULL) {
+		free(entries);
+		free(min);
+		free(max);
+		return ERR;
+	}
+
+	pthread_mutex_lock(&agg->mutex);
+
+	/* slots are taken modulo the size, so every entry has to be moved */
+	for (unsigned long seq = aggregate_oldest(agg); seq < agg->count; seq++) {
+		entries[seq & (size - 1)] = agg->entries[seq & (agg->size - 1)];
+	}
+
+	for (unsigned long pos = agg->min.head; pos < agg->min.tail; pos++) {
+		min[pos & (size - 1)] = agg->min.seqs[pos & (agg->size - 1)];
+	}
+
+	for (unsigned long pos = agg->max.head; pos < agg->max.tail; pos++) {
+		max[pos & (size - 1)] = agg->max.seqs[pos & (agg->size - 1)];
+	}
+
+	free(agg->entries);
+	free(agg->min.seqs);
+	free(agg->max.seqs);
+
+	agg->base = aggregate_oldest(agg);
+	agg->entries = entries;
+	agg->min.seqs = min;
+	agg->max.seqs = max;
+	agg->size = size;
+
+	pthread_mutex_unlock(&agg->mutex);
+
+	return SUCCESS;
+}
+
+/**
+ * Append a reading to a monotonic deque
+ *
+ * Readings which have left the ring are expired from the head,
+ * readings which cannot be the extremum of any suffix anymore are dropped from the tail.
+ */
+static void aggregate_deque_push(aggregate_t *agg, aggregate_deque_t *deque, unsigned long seq, int max) {
+	size_t mask = agg->size - 1;
+	unsigned long oldest = aggregate_oldest(agg);
+	double value = agg->entries[seq & mask].value;
+
+	while (deque->head < deque->tail && deque->seqs[deque->head & mask] < oldest) {
+		deque->head++;
+	}
+
+	while (deque->head < deque->tail) {
+		double last = agg->entries[deque->seqs[(deque->tail - 1) & mask] & mask].value;
+
+		if ((max) ? last > value : last < value) {
+			break;
+		}
+
+		deque->tail--;
+	}
+
+	deque->seqs[deque->tail++ & mask] = seq;
+}
+
+/**
+ * Get the extremum of all readings since seq from a monotonic deque
+ *
+ * It's the oldest candidate which is not older than seq.
+ */
+static double aggregate_deque_query(aggregate_t *agg, aggregate_deque_t *deque, unsigned long seq) {
+	size_t mask = agg->size - 1;
+	unsigned long lo = deque->head, hi = deque->tail - 1; /* the newest reading is always a candidate */
+
+	while (lo < hi) {
+		unsigned long mid = lo + (hi - lo) / 2;
+
+		if (deque->seqs[mid & mask] < seq) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return agg->entries[deque->seqs[lo & mask] & mask].value;
+}
+
+void aggregate_push(aggregate_t *agg, reading_t *rd) {
+	/* a single NAN would spoil the running sums forever */
+	if (agg->size == 0 || !isfinite(rd->value)) {
+		return;
+	}
+
+	pthread_mutex_lock(&agg->mutex);
+
+	size_t mask = agg->size - 1;
+	unsigned long seq = agg->count;
+	aggregate_entry_t *entry = &agg->entries[seq & mask];
+
+	entry->time = (long long) rd->time.tv_sec * 1000 + rd->time.tv_usec / 1000;
+
+	if (seq > 0) {
+		aggregate_entry_t *prev = &agg->entries[(seq - 1) & mask];
+		long long delta = entry->time - prev->time;
+
+		entry->sum = prev->sum + prev->value;
+		entry->integral = prev->integral + rd->value * ((delta > 0) ? delta : 0) / 3600000.0;
+	}
+	else {
+		entry->sum = 0;
+		entry->integral = 0;
+	}
+
+	entry->value = rd->value;
+	agg->count++;
+
+	aggregate_deque_push(agg, &agg->min, seq, FALSE);
+	aggregate_deque_push(agg, &agg->max, seq, TRUE);
+
+	pthread_mutex_unlock(&agg->mutex);
+}
+
+void aggregate_query(aggregate_t *agg, long long since, double values[AGGREGATE_TYPES]) {
+	for (int i = 0; i < AGGREGATE_TYPES; i++) {
+		values[i] = NAN;
+	}
+
+	values[AGGREGATE_COUNT] = 0;
+	values[AGGREGATE_SUM] = 0;
+	values[AGGREGATE_INTEGRAL] = 0;
+
+	pthread_mutex_lock(&agg->mutex);
+
+	size_t mask = agg->size - 1;
+	unsigned long lo = aggregate_oldest(agg), hi = agg->count;
+
+	/* first reading not older than since */
+	while (lo < hi) {
+		unsigned long mid = lo + (hi - lo) / 2;
+
+		if (agg->entries[mid & mask].time < since) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	if (lo < agg->count) {
+		aggregate_entry_t *first = &agg->entries[lo & mask];
+		aggregate_entry_t *last = &agg->entries[(agg->count - 1) & mask];
+		unsigned long n = agg->count - lo;
+
+		values[AGGREGATE_COUNT] = n;
+		values[AGGREGATE_SUM] = last->sum + last->value - first->sum;
+		values[AGGREGATE_MEAN] = values[AGGREGATE_SUM] / n;
+		values[AGGREGATE_MIN] = aggregate_deque_query(agg, &agg->min, lo);
+		values[AGGREGATE_MAX] = aggregate_deque_query(agg, &agg->max, lo);
+		values[AGGREGATE_LAST] = last->value;
+		values[AGGREGATE_INTEGRAL] = last->integral - first->integral;
+	}
+
+	pthread_mutex_unlock(&agg->mutex);
+}
+
+int aggregate_parse(const char *str) {
+	int mask = 0;
+
+	while (TRUE) {
+		size_t len = strcspn(str, ",");
+		int type;
+
+		for (type = 0; type < AGGREGATE_TYPES; type++) {
+			if (strlen(aggregate_names[type]) == len && strncmp(aggregate_names[type], str, len) == 0) {
+				break;
+			}
+		}
+
+		if (type == AGGREGATE_TYPES) {
+			return 0; /* unknown type */
+		}
+
+		mask |= 1 << type;
+
+		if (str[len] == '\0') {
+			return mask;
+		}
+
+		str += len + 1;
+	}
+}
+
+const char * aggregate_name(aggregate_type_t type) {
+	return aggregate_names[type];
+}
@@ -36,7 +36,7 @@
 extern config_options_t options;
 
 int curl_custom_debug_callback(CURL *curl, curl_infotype type, char *data, size_t size, void *arg) {
-	channel_t *ch = (channel_t *) arg;
+	char *id = (char *) arg;
 	char *end = strchr(data, '\n');
 
 	if (data == end) return 0; /* skip empty line */
@@ -45,17 +45,17 @@ int curl_custom_debug_callback(CURL *curl, curl_infotype type, char *data, size_
 		case CURLINFO_TEXT:
 		case CURLINFO_END:
 			if (end) *end = '\0'; /* terminate without \n */
-			print(log_debug+5, "CURL: %.*s", ch, (int) size, data);
+			print(log_debug+5, "CURL: %.*s", id, (int) size, data);
 			break;
 
 		case CURLINFO_SSL_DATA_IN:
 		case CURLINFO_DATA_IN:
-			print(log_debug+5, "CURL: Received %lu bytes", ch, (unsigned long) size);
+			print(log_debug+5, "CURL: Received %lu bytes", id, (unsigned long) size);
 			break;
 
 		case CURLINFO_SSL_DATA_OUT:
 		case CURLINFO_DATA_OUT:
-			print(log_debug+5, "CURL: Sent %lu bytes.. ", ch, (unsigned long) size);
+			print(log_debug+5, "CURL: Sent %lu bytes.. ", id, (unsigned long) size);
 			break;
 
 		case CURLINFO_HEADER_IN:
@@ -68,56 +68,439 @@ int curl_custom_debug_callback(CURL *curl, curl_infotype type, char *data, size_
 
 size_t curl_custom_write_callback(void *ptr, size_t size, size_t nmemb, void *data) {
 	size_t realsize = size * nmemb;
-	CURLresponse *response = (CURLresponse *) data;
+	api_buffer_t *response = (api_buffer_t *) data;
 
-	response->data = realloc(response->data, response->size + realsize + 1);
-	if (response->data == NULL) { /* out of memory! */
-		print(log_error, "Cannot allocate memory", NULL);
-		exit(EXIT_FAILURE);
+	api_buffer_append(response, (const char *) ptr, realsize);
+
+	return realsize;
+}
+
+void api_buffer_init(api_buffer_t *b) {
+	b->data = NULL;
+	b->size = 0;
+	b->length = 0;
+}
+
+void api_buffer_free(api_buffer_t *b) {
+	free(b->data);
+	api_buffer_init(b);
+}
+
+void api_buffer_clear(api_buffer_t *b) {
+	b->length = 0;
+
+	if (b->data) {
+		b->data[0] = '\0';
+	}
+}
+
+/**
+ * Make room for at least n more bytes plus terminating null
+ */
+void api_buffer_reserve(api_buffer_t *b, size_t n) {
+	if (b->length + n + 1 > b->size) {
+		size_t size = (b->size) ? b->size : 256;
+
+		while (size < b->length + n + 1) {
+			size *= 2;
+		}
+
+		b->data = realloc(b->data, size);
+		if (b->data == NULL) { /* out of memory! */
+			print(log_error, "Cannot allocate memory", NULL);
+			exit(EXIT_FAILURE);
+		}
+
+		b->size = size;
 	}
+}
 
-	memcpy(&(response->data[response->size]), ptr, realsize);
-	response->size += realsize;
-	response->data[response->size] = 0;
+void api_buffer_append(api_buffer_t *b, const char *str, size_t len) {
+	api_buffer_reserve(b, len);
 
-	return realsize;
+	memcpy(b->data + b->length, str, len);
+	b->length += len;
+	b->data[b->length] = '\0';
+}
+
+/**
+ * Format fixed-point number without trailing zeros in its fraction
+ *
+ * @param str has to hold at least 22 chars
+ * @param scaled the number multiplied by 10^decimals
+ * @return the number of chars written (without terminating null)
+ */
+static size_t api_json_fixed(char *str, long long scaled, int decimals) {
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	unsigned long long u = (scaled < 0) ? -(unsigned long long) scaled : (unsigned long long) scaled;
+
+	/* strip trailing zeros of fraction */
+	while (decimals > 0 && u % 10 == 0) {
+		u /= 10;
+		decimals--;
+	}
+
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+
+		if (--decimals == 0) {
+			*--p = '.';
+		}
+	} while (u > 0 || decimals >= 0);
+
+	if (scaled < 0) {
+		*--p = '-';
+	}
+
+	memcpy(str, p, tmp + sizeof(tmp) - p);
+
+	return tmp + sizeof(tmp) - p;
+}
+
+/**
+ * Format double with up to 6 decimal places
+ */
+static size_t api_json_format_double(char *str, double value) {
+	if (!isfinite(value)) {
+		memcpy(str, "null", 4);
+		return 4;
+	}
+	else if (fabs(value) < 9e12) { /* fits into long long after scaling */
+		return api_json_fixed(str, llround(value * 1e6), 6);
+	}
+	else {
+		return snprintf(str, 32, "%.17g", value);
+	}
+}
+
+void api_json_string(api_buffer_t *b, const char *str) {
+	api_buffer_reserve(b, 6 * strlen(str) + 2); /* worst case: all chars escaped */
+
+	char *p = b->data + b->length;
+
+	*p++ = '"';
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		}
+		else if (c < 0x20) {
+			p += sprintf(p, "\\u%04x", c);
+		}
+		else {
+			*p++ = c;
+		}
+	}
+	*p++ = '"';
+	*p = '\0';
+
+	b->length = p - b->data;
+}
+
+void api_json_double(api_buffer_t *b, double value) {
+	api_buffer_reserve(b, 32);
+
+	b->length += api_json_format_double(b->data + b->length, value);
+	b->data[b->length] = '\0';
+}
+
+void api_json_int(api_buffer_t *b, long long value) {
+	api_buffer_reserve(b, 24);
+
+	b->length += api_json_fixed(b->data + b->length, value, 0);
+	b->data[b->length] = '\0';
+}
+
+static void api_json_add_tuples(api_buffer_t *b, reading_t *rds, size_t n, int first) {
+	api_buffer_reserve(b, n * API_TUPLE_LENGTH);
+
+	char *p = b->data + b->length;
+
+	for (size_t i = 0; i < n; i++) {
+		/* API requires milliseconds */
+		long long timestamp = (long long) rds[i].time.tv_sec * 1000 + rds[i].time.tv_usec / 1000;
+
+		if (!first || i > 0) {
+			*p++ = ',';
+		}
+
+		*p++ = '[';
+		p += api_json_fixed(p, timestamp, 0);
+		*p++ = ',';
+		p += api_json_format_double(p, rds[i].value);
+		*p++ = ']';
+	}
+
+	*p = '\0';
+	b->length = p - b->data;
+}
+
+void api_json_readings(api_buffer_t *b, reading_t *rds, size_t n) {
+	api_buffer_append(b, "[", 1);
+	api_json_add_tuples(b, rds, n, TRUE);
+	api_buffer_append(b, "]", 1);
+}
+
+/**
+ * Write CBOR head of a data item
+ *
+ * @param major the major type (0-7)
+ * @param value the argument: integer, length or count
+ * @return pointer after the head (at most 9 bytes)
+ */
+static char * api_cbor_put(char *p, int major, unsigned long long value) {
+	unsigned char *u = (unsigned char *) p;
+	int bytes;
+
+	if (value < 24) {
+		*u++ = (major << 5) | value;
+		return (char *) u;
+	}
+	else if (value <= 0xff) {
+		*u++ = (major << 5) | 24;
+		bytes = 1;
+	}
+	else if (value <= 0xffff) {
+		*u++ = (major << 5) | 25;
+		bytes = 2;
+	}
+	else if (value <= 0xffffffff) {
+		*u++ = (major << 5) | 26;
+		bytes = 4;
+	}
+	else {
+		*u++ = (major << 5) | 27;
+		bytes = 8;
+	}
+
+	/* network byte order */
+	for (int i = bytes - 1; i >= 0; i--) {
+		*u++ = value >> (8 * i);
+	}
+
+	return (char *) u;
+}
+
+static char * api_cbor_put_int(char *p, long long value) {
+	return (value < 0)
+		? api_cbor_put(p, 1, -1 - value)
+		: api_cbor_put(p, 0, value);
+}
+
+static char * api_cbor_put_double(char *p, double value) {
+	unsigned long long bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+
+	*p++ = (char) 0xfb; /* major type 7, 64 bit float */
+
+	for (int i = 7; i >= 0; i--) {
+		*p++ = bits >> (8 * i);
+	}
+
+	return p;
+}
+
+static void api_cbor_head(api_buffer_t *b, int major, size_t n) {
+	api_buffer_reserve(b, 9);
+
+	char *p = b->data + b->length;
+
+	if (n == API_CBOR_INDEFINITE) {
+		*p++ = (major << 5) | 31;
+	}
+	else {
+		p = api_cbor_put(p, major, n);
+	}
+
+	*p = '\0';
+	b->length = p - b->data;
+}
+
+void api_cbor_map(api_buffer_t *b, size_t n) {
+	api_cbor_head(b, 5, n);
 }
 
-json_object * api_json_tuples(buffer_t *buf, reading_t *first, reading_t *last) {
-	json_object *json_tuples = json_object_new_array();
-	reading_t *it;
+void api_cbor_array(api_buffer_t *b, size_t n) {
+	api_cbor_head(b, 4, n);
+}
+
+void api_cbor_break(api_buffer_t *b) {
+	api_buffer_append(b, "\xff", 1);
+}
+
+void api_cbor_string(api_buffer_t *b, const char *str) {
+	size_t len = strlen(str);
+
+	api_cbor_head(b, 3, len); /* UTF-8 text */
+	api_buffer_append(b, str, len);
+}
+
+void api_cbor_double(api_buffer_t *b, double value) {
+	api_buffer_reserve(b, 9);
+
+	char *p = api_cbor_put_double(b->data + b->length, value);
+
+	*p = '\0';
+	b->length = p - b->data;
+}
+
+void api_cbor_int(api_buffer_t *b, long long value) {
+	api_buffer_reserve(b, 9);
+
+	char *p = api_cbor_put_int(b->data + b->length, value);
+
+	*p = '\0';
+	b->length = p - b->data;
+}
+
+unsigned long api_cbor_tuples(api_buffer_t *b, buffer_t *buf, unsigned long from, unsigned long to, size_t max) {
+	reading_t rds[API_CHUNK_SIZE];
+	size_t n, count;
+
+	api_cbor_array(b, API_CBOR_INDEFINITE);
+
+	/* copy readings chunkwise out of the buffer without locking */
+	while (b->length < max) {
+		/* shrink chunks when approaching the limit */
+		count = (max - b->length) / API_CBOR_TUPLE_LENGTH + 1;
+		if (count > API_CHUNK_SIZE) {
+			count = API_CHUNK_SIZE;
+		}
+
+		if ((n = buffer_read(buf, &from, to, rds, count)) == 0) {
+			break;
+		}
+
+		api_buffer_reserve(b, n * API_CBOR_TUPLE_LENGTH);
+
+		char *p = b->data + b->length;
+
+		for (size_t i = 0; i < n; i++) {
+			/* API requires milliseconds */
+			long long timestamp = (long long) rds[i].time.tv_sec * 1000 + rds[i].time.tv_usec / 1000;
+
+			p = api_cbor_put(p, 4, 2);
+			p = api_cbor_put_int(p, timestamp);
+			p = api_cbor_put_double(p, rds[i].value);
+		}
+
+		*p = '\0';
+		b->length = p - b->data;
+		from += n;
+	}
+
+	api_cbor_break(b);
+
+	return from;
+}
+
+unsigned long api_json_tuples(api_buffer_t *b, buffer_t *buf, unsigned long from, unsigned long to, size_t max) {
+	reading_t rds[API_CHUNK_SIZE];
+	size_t n, count;
+	int first = TRUE;
+
+	api_buffer_append(b, "[", 1);
+
+	/* copy readings chunkwise out of the buffer without locking */
+	while (b->length < max) {
+		/* shrink chunks when approaching the limit */
+		count = (max - b->length) / API_TUPLE_LENGTH + 1;
+		if (count > API_CHUNK_SIZE) {
+			count = API_CHUNK_SIZE;
+		}
+
+		if ((n = buffer_read(buf, &from, to, rds, count)) == 0) {
+			break;
+		}
+
+		api_json_add_tuples(b, rds, n, first);
+		from += n;
+		first = FALSE;
+	}
+
+	api_buffer_append(b, "]", 1);
+
+	return from;
+}
+
+int api_init(channel_t *ch, const char *middleware, api_handle_t *api) {
+	char *url = malloc(strlen(middleware) + strlen(ch->uuid) + 12);
+
+	if (url == NULL) {
+		print(log_error, "Cannot allocate memory", ch);
+		return ERR;
+	}
+
+	sprintf(url, "%s/data/%s.json", middleware, ch->uuid);			/* build url */
+
+	return api_init_url(api, url, ch->id);
+}
+
+int api_init_middleware(const char *middleware, api_handle_t *api) {
+	char *url = malloc(strlen(middleware) + 11);
+
+	if (url == NULL) {
+		print(log_error, "Cannot allocate memory", NULL);
+		return ERR;
+	}
 
-	for (it = first; it != NULL && it != last->next; it = it->next) {
-		struct json_object *json_tuple = json_object_new_array();
+	sprintf(url, "%s/data.json", middleware);					/* build url */
 
-		pthread_mutex_lock(&buf->mutex);
+	return api_init_url(api, url, NULL);
+}
 
-		// TODO use long int of new json-c version
-		// API requires milliseconds => * 1000
-		double timestamp = tvtod(it->time) * 1000; 
-		double value = it->value;
-		pthread_mutex_unlock(&buf->mutex);
+/* headers are the same for all handles, so they are built only once */
+static struct curl_slist *api_headers;
+static struct curl_slist *api_headers_gzip;	/* additionally with Content-Encoding: gzip */
+static int api_handles;
 
-		json_object_array_add(json_tuple, json_object_new_double(timestamp));
-		json_object_array_add(json_tuple, json_object_new_double(value));
+static int api_headers_init() {
+	const char *format = "User-Agent: %s/%s (%s)";
+	char *agent = malloc(strlen(format) + strlen(PACKAGE) + strlen(VERSION) + strlen(curl_version()));
 
-		json_object_array_add(json_tuples, json_tuple);
+	if (agent == NULL) {
+		print(log_error, "Cannot allocate memory", NULL);
+		return ERR;
 	}
 
-	return json_tuples;
+	sprintf(agent, format, PACKAGE, VERSION, curl_version());		/* build user agent */
+
+	api_headers = curl_slist_append(api_headers, "Content-type: application/json");
+	api_headers = curl_slist_append(api_headers, "Accept: application/json");
+	api_headers = curl_slist_append(api_headers, agent);
+
+	api_headers_gzip = curl_slist_append(api_headers_gzip, "Content-type: application/json");
+	api_headers_gzip = curl_slist_append(api_headers_gzip, "Content-Encoding: gzip");
+	api_headers_gzip = curl_slist_append(api_headers_gzip, "Accept: application/json");
+	api_headers_gzip = curl_slist_append(api_headers_gzip, agent);
+
+	free(agent);
+
+	return SUCCESS;
 }
 
-int api_init(channel_t *ch, api_handle_t *api) {
-	char url[255], agent[255];
+int api_init_url(api_handle_t *api, char *url, void *id) {
+	if (api_handles == 0 && api_headers_init() != SUCCESS) {
+		free(url);
+		return ERR;
+	}
+
+	api_handles++;
 
-	/* prepare header, uuid & url */
-	sprintf(agent, "User-Agent: %s/%s (%s)", PACKAGE, VERSION, curl_version());	/* build user agent */
-	sprintf(url, "%s/data/%s.json", ch->middleware, ch->uuid);			/* build url */
+	api_buffer_init(&api->body);
+	api_buffer_init(&api->compressed);
+	api_buffer_init(&api->response);
 
-	api->headers = NULL;
-	api->headers = curl_slist_append(api->headers, "Content-type: application/json");
-	api->headers = curl_slist_append(api->headers, "Accept: application/json");
-	api->headers = curl_slist_append(api->headers, agent);
+	api->url = url;
+	api->headers = api_headers;
+	api->zstream_init = FALSE;
+	api->bytes_raw = 0;
+	api->bytes_sent = 0;
 
 	api->curl = curl_easy_init();
 	if (!api->curl) {
@@ -126,24 +509,112 @@ int api_init(channel_t *ch, api_handle_t *api) {
 
 	curl_easy_setopt(api->curl, CURLOPT_URL, url);
 	curl_easy_setopt(api->curl, CURLOPT_HTTPHEADER, api->headers);
+	curl_easy_setopt(api->curl, CURLOPT_WRITEFUNCTION, curl_custom_write_callback);
+	curl_easy_setopt(api->curl, CURLOPT_WRITEDATA, (void *) &api->response);
 	curl_easy_setopt(api->curl, CURLOPT_VERBOSE, options.verbosity);
 	curl_easy_setopt(api->curl, CURLOPT_DEBUGFUNCTION, curl_custom_debug_callback);
-	curl_easy_setopt(api->curl, CURLOPT_DEBUGDATA, (void *) ch);
+	curl_easy_setopt(api->curl, CURLOPT_DEBUGDATA, id);
 
 	return EXIT_SUCCESS;
 }
 
 void api_free(api_handle_t *api) {
 	curl_easy_cleanup(api->curl);
-	curl_slist_free_all(api->headers);
+	api_buffer_free(&api->body);
+	api_buffer_free(&api->compressed);
+	api_buffer_free(&api->response);
+	free(api->url);
+
+	if (--api_handles == 0) {
+		curl_slist_free_all(api_headers);
+		curl_slist_free_all(api_headers_gzip);
+		api_headers = NULL;
+		api_headers_gzip = NULL;
+	}
+
+	if (api->zstream_init) {
+		deflateEnd(&api->zstream);
+	}
 }
 
-int api_parse_exception(CURLresponse response, char *err, size_t n) {
+/**
+ * Compress request body with gzip into api->compressed
+ *
+ * @return 0 on success, <0 on error
+ */
+static int api_compress(api_handle_t *api) {
+	z_stream *zs = &api->zstream;
+
+	if (!api->zstream_init) {
+		memset(zs, 0, sizeof(z_stream));
+
+		/* 16 + MAX_WBITS: gzip header instead of zlib */
+		if (deflateInit2(zs, options.compress_level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return ERR;
+		}
+
+		api->zstream_init = TRUE;
+	}
+	else if (deflateReset(zs) != Z_OK) {
+		return ERR;
+	}
+
+	api_buffer_clear(&api->compressed);
+	api_buffer_reserve(&api->compressed, deflateBound(zs, api->body.length));
+
+	zs->next_in = (Bytef *) api->body.data;
+	zs->avail_in = api->body.length;
+	zs->next_out = (Bytef *) api->compressed.data;
+	zs->avail_out = api->compressed.size;
+
+	if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+		return ERR;
+	}
+
+	api->compressed.length = zs->total_out;
+
+	return SUCCESS;
+}
+
+void api_prepare(api_handle_t *api, void *id) {
+	api_buffer_t *body = &api->body;
+	struct curl_slist *headers = api_headers;
+
+	if (options.compress && body->length >= options.compress_threshold) {
+		if (api_compress(api) == SUCCESS) {
+			body = &api->compressed;
+			headers = api_headers_gzip;
+		}
+		else {
+			print(log_error, "Cannot compress request body", id);
+		}
+	}
+
+	api->bytes_raw += api->body.length;
+	api->bytes_sent += body->length;
+
+	print(log_debug, "Request body: %zu bytes, %zu bytes sent (total: %llu bytes, %llu bytes sent)", id,
+		api->body.length, body->length, api->bytes_raw, api->bytes_sent);
+
+	if (headers != api->headers) { /* switch between plain and compressed body */
+		curl_easy_setopt(api->curl, CURLOPT_HTTPHEADER, headers);
+		api->headers = headers;
+	}
+
+	curl_easy_setopt(api->curl, CURLOPT_POSTFIELDSIZE, (long) body->length);
+	curl_easy_setopt(api->curl, CURLOPT_POSTFIELDS, body->data);
+}
+
+int api_parse_exception(api_buffer_t *response, char *err, size_t n) {
 	struct json_tokener *json_tok;
 	struct json_object *json_obj;
 
+	if (response->length == 0) {
+		return ERR;
+	}
+
 	json_tok = json_tokener_new();
-	json_obj = json_tokener_parse_ex(json_tok, response.data, response.size);
+	json_obj = json_tokener_parse_ex(json_tok, response->data, response->length);
 
 	if (json_tok->err != json_tokener_success) {
 		json_tokener_free(json_tok);
@@ -0,0 +1,184 @@
+/**
+ * Benchmark of the routing of readings to channels
+ *
+ * Routes a datagram of readings with OBIS identifiers to the channels
+ * of an SML meter, once by comparing every reading with every channel,
+ * as vzlogger did before dispatch_lookup(), and once by the dispatch table.
+ * The comparison is done group by group, as obis_compare() did before the
+ * identifiers were packed, and with the packed identifiers.
+ *
+ * Usage: bench_dispatch [channels] [rounds]
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "channel.h"
+#include "dispatch.h"
+#include "list.h"
+
+void print(log_level_t level, const char *format, void *id, ... ) {
+	va_list args;
+
+	if (level <= log_error) {
+		va_start(args, id);
+		vfprintf(stderr, format, args);
+		fprintf(stderr, "\n");
+		va_end(args);
+	}
+}
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Compare OBIS identifiers group by group like obis_compare() did before
+ */
+static int bench_obis_compare(obis_id_t a, obis_id_t b) {
+	for (int i = 0; i < 6; i++) {
+		if (a.raw[i] == b.raw[i] || a.raw[i] == 0xff || b.raw[i] == 0xff ) {
+			continue; /* skip on wildcard or equal */
+		}
+		else if (a.raw[i] < b.raw[i]) {
+			return -1;
+		}
+		else if (a.raw[i] > b.raw[i]) {
+			return 1;
+		}
+	}
+
+	return 0; /* equal */
+}
+
+/**
+ * Route readings like the reading thread did before the dispatch table
+ *
+ * @param compare obis_compare() or its former implementation
+ * @return the number of matches
+ */
+static size_t bench_compare(list_t *channels, reading_t *rds, size_t n, int (*compare)(obis_id_t, obis_id_t)) {
+	size_t matches = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		foreach(*channels, ch, channel_t) {
+			if (compare(rds[i].identifier.obis, ch->identifier.obis) == 0) {
+				matches++;
+			}
+		}
+	}
+
+	return matches;
+}
+
+/**
+ * Route readings by the dispatch table
+ *
+ * @return the number of matches
+ */
+static size_t bench_dispatch(dispatch_t *d, reading_t *rds, size_t n) {
+	size_t matches = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t count;
+
+		dispatch_lookup(d, rds[i].identifier, &count);
+		matches += count;
+	}
+
+	return matches;
+}
+
+int main(int argc, char *argv[]) {
+	size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 32;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 100000;
+	size_t matches = 0;
+	double start, bytes, compare, dispatch;
+
+	channel_t *chs = calloc(n, sizeof(channel_t));
+	reading_t *rds = calloc(n, sizeof(reading_t));
+	list_t channels;
+	dispatch_t d;
+
+	if (chs == NULL || rds == NULL || n == 0 || n > 255 * 8 || rounds <= 0) {
+		fprintf(stderr, "Usage: %s [channels] [rounds]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* an SML datagram with the registers of the channels in reverse order, e.g. 1-0:1.8.1 */
+	list_init(&channels);
+	for (size_t i = 0; i < n; i++) {
+		char obis[16];
+		snprintf(obis, sizeof(obis), "1-0:%zu.8.%zu", 1 + i / 8, i % 8);
+
+		if (reading_id_parse(meter_protocol_sml, &chs[i].identifier, obis) != SUCCESS) {
+			fprintf(stderr, "Cannot parse %s\n", obis);
+			return EXIT_FAILURE;
+		}
+
+		rds[n - 1 - i].identifier = chs[i].identifier;
+		rds[n - 1 - i].identifier.obis.raw[5] = 0xff; /* SML meters send F = 255 */
+		list_push(&channels, &chs[i]);
+	}
+
+	if (dispatch_init(&d, meter_protocol_sml, &channels) != SUCCESS) {
+		fprintf(stderr, "Cannot initialize dispatch table\n");
+		return EXIT_FAILURE;
+	}
+
+	start = bench_now();
+	for (int i = 0; i < rounds; i++) {
+		matches = bench_compare(&channels, rds, n, &bench_obis_compare);
+	}
+	bytes = (bench_now() - start) / rounds;
+	printf("bytewise: %8.1f ns per datagram, %6.1f ns per reading, %zu matches\n", bytes * 1e9, bytes * 1e9 / n, matches);
+
+	start = bench_now();
+	for (int i = 0; i < rounds; i++) {
+		matches = bench_compare(&channels, rds, n, &obis_compare);
+	}
+	compare = (bench_now() - start) / rounds;
+	printf("packed:   %8.1f ns per datagram, %6.1f ns per reading, %zu matches\n", compare * 1e9, compare * 1e9 / n, matches);
+
+	start = bench_now();
+	for (int i = 0; i < rounds; i++) {
+		matches = bench_dispatch(&d, rds, n);
+	}
+	dispatch = (bench_now() - start) / rounds;
+	printf("dispatch: %8.1f ns per datagram, %6.1f ns per reading, %zu matches\n", dispatch * 1e9, dispatch * 1e9 / n, matches);
+
+	printf("speedup:  %8.1fx (%.1fx over bytewise)\n", compare / dispatch, bytes / dispatch);
+
+	dispatch_free(&d);
+	free(chs);
+	free(rds);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+/**
+ * Benchmark of the JSON encoding of readings
+ *
+ * Encodes the same backlog of tuples with json-c, as vzlogger did
+ * before api_json_readings(), and with the streaming encoder.
+ *
+ * Usage: bench_json [tuples] [rounds]
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <json/json.h>
+
+#include "api.h"
+#include "vzlogger.h"
+
+config_options_t options;
+
+void print(log_level_t level, const char *format, void *id, ... ) {
+	va_list args;
+
+	if (level <= log_error) {
+		va_start(args, id);
+		vfprintf(stderr, format, args);
+		fprintf(stderr, "\n");
+		va_end(args);
+	}
+}
+
+static double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Encode readings like api_json_tuples() did with json-c
+ *
+ * @return the length of the serialized body
+ */
+static size_t bench_json_c(reading_t *rds, size_t n) {
+	struct json_object *json_tuples = json_object_new_array();
+
+	for (size_t i = 0; i < n; i++) {
+		struct json_object *json_tuple = json_object_new_array();
+
+		double timestamp = tvtod(rds[i].time) * 1000;
+		double value = rds[i].value;
+
+		json_object_array_add(json_tuple, json_object_new_double(timestamp));
+		json_object_array_add(json_tuple, json_object_new_double(value));
+
+		json_object_array_add(json_tuples, json_tuple);
+	}
+
+	size_t length = strlen(json_object_to_json_string(json_tuples));
+	json_object_put(json_tuples);
+
+	return length;
+}
+
+/**
+ * Encode readings with the streaming encoder into a reused buffer
+ *
+ * @return the length of the body
+ */
+static size_t bench_api_buffer(api_buffer_t *body, reading_t *rds, size_t n) {
+	api_buffer_clear(body);
+	api_json_readings(body, rds, n);
+
+	return body->length;
+}
+
+int main(int argc, char *argv[]) {
+	size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 10000;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 100;
+	size_t length = 0;
+	double start, json_c, api;
+
+	reading_t *rds = malloc(n * sizeof(reading_t));
+	api_buffer_t body;
+
+	if (rds == NULL || n == 0 || rounds <= 0) {
+		fprintf(stderr, "Usage: %s [tuples] [rounds]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* power readings of a meter every two seconds */
+	srand(1);
+	memset(rds, 0, n * sizeof(reading_t));
+	for (size_t i = 0; i < n; i++) {
+		rds[i].time.tv_sec = 1318000000 + 2 * i;
+		rds[i].time.tv_usec = (i * 1237) % 1000000;
+		rds[i].value = (rand() % 500000) / 100.0;
+	}
+
+	api_buffer_init(&body);
+	bench_api_buffer(&body, rds, n); /* warm up, allocates the buffer */
+
+	start = bench_now();
+	for (int i = 0; i < rounds; i++) {
+		length = bench_json_c(rds, n);
+	}
+	json_c = (bench_now() - start) / rounds;
+	printf("json-c:     %8.1f us per backlog, %6.1f ns per tuple, %zu bytes\n", json_c * 1e6, json_c * 1e9 / n, length);
+
+	start = bench_now();
+	for (int i = 0; i < rounds; i++) {
+		length = bench_api_buffer(&body, rds, n);
+	}
+	api = (bench_now() - start) / rounds;
+	printf("api_buffer: %8.1f us per backlog, %6.1f ns per tuple, %zu bytes\n", api * 1e6, api * 1e9 / n, length);
+
+	printf("speedup:    %8.1fx\n", json_c / api);
+
+	api_buffer_free(&body);
+	free(rds);
+
+	return EXIT_SUCCESS;
+}
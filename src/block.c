@@ -0,0 +1,210 @@
+/**
+ * Compressed blocks of readings
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "block.h"
+#include "common.h"
+
+#define BLOCK_BITS (8 * sizeof(((block_t *) 0)->data))
+
+/**
+ * Append the n least significant bits of val
+ *
+ * @return 0 on success, <0 if the block is full
+ */
+static int block_write(block_coder_t *enc, uint64_t val, int n) {
+	if (enc->pos + n > BLOCK_BITS) {
+		return ERR;
+	}
+
+	for (int i = n - 1; i >= 0; i--, enc->pos++) {
+		unsigned char mask = 0x80 >> (enc->pos % 8);
+
+		if ((val >> i) & 1) {
+			enc->block->data[enc->pos / 8] |= mask;
+		}
+		else {
+			enc->block->data[enc->pos / 8] &= ~mask;
+		}
+	}
+
+	return SUCCESS;
+}
+
+static uint64_t block_read(block_coder_t *dec, int n) {
+	uint64_t val = 0;
+
+	for (int i = 0; i < n; i++, dec->pos++) {
+		val = (val << 1) | ((dec->block->data[dec->pos / 8] >> (7 - dec->pos % 8)) & 1);
+	}
+
+	return val;
+}
+
+static int64_t block_sign_extend(uint64_t val, int n) {
+	return (int64_t) (val << (64 - n)) >> (64 - n);
+}
+
+void block_encoder_init(block_coder_t *enc, block_t *block, unsigned long seq) {
+	memset(enc, 0, sizeof(block_coder_t));
+
+	enc->block = block;
+	enc->block->seq = seq;
+	enc->block->count = 0;
+}
+
+int block_encode(block_coder_t *enc, const reading_t *rd) {
+	block_coder_t state = *enc; /* for rollback */
+	int64_t time = (int64_t) rd->time.tv_sec * 1000 + rd->time.tv_usec / 1000;
+	uint64_t value;
+	int ret = SUCCESS;
+
+	memcpy(&value, &rd->value, sizeof(value));
+
+	if (enc->block->count == 0) { /* first reading is stored uncompressed */
+		ret |= block_write(enc, time, 64);
+		ret |= block_write(enc, value, 64);
+	}
+	else {
+		/* timestamp: delta-of-delta with variable length buckets */
+		int64_t delta = time - enc->time;
+		int64_t dod = delta - enc->delta;
+
+		if (dod == 0) {
+			ret |= block_write(enc, 0x0, 1);
+		}
+		else if (dod >= -64 && dod <= 63) {
+			ret |= block_write(enc, 0x2, 2);
+			ret |= block_write(enc, dod, 7);
+		}
+		else if (dod >= -256 && dod <= 255) {
+			ret |= block_write(enc, 0x6, 3);
+			ret |= block_write(enc, dod, 9);
+		}
+		else if (dod >= -2048 && dod <= 2047) {
+			ret |= block_write(enc, 0xe, 4);
+			ret |= block_write(enc, dod, 12);
+		}
+		else {
+			ret |= block_write(enc, 0xf, 4);
+			ret |= block_write(enc, dod, 64);
+		}
+
+		enc->delta = delta;
+
+		/* value: XOR with previous value, storing only the meaningful bits */
+		uint64_t xor = value ^ enc->value;
+
+		if (xor == 0) {
+			ret |= block_write(enc, 0x0, 1);
+		}
+		else {
+			int leading = __builtin_clzll(xor);
+			int trailing = __builtin_ctzll(xor);
+
+			if (leading > 31) {
+				leading = 31; /* has to fit into 5 bits */
+			}
+
+			if (enc->block->count > 1 && leading >= enc->leading && trailing >= enc->trailing) {
+				/* reuse window of previous value */
+				ret |= block_write(enc, 0x2, 2);
+				ret |= block_write(enc, xor >> enc->trailing, 64 - enc->leading - enc->trailing);
+			}
+			else {
+				int meaningful = 64 - leading - trailing;
+
+				ret |= block_write(enc, 0x3, 2);
+				ret |= block_write(enc, leading, 5);
+				ret |= block_write(enc, meaningful - 1, 6);
+				ret |= block_write(enc, xor >> trailing, meaningful);
+
+				enc->leading = leading;
+				enc->trailing = trailing;
+			}
+		}
+	}
+
+	if (ret != SUCCESS) {
+		*enc = state; /* block is full */
+		return ERR;
+	}
+
+	enc->time = time;
+	enc->value = value;
+	enc->block->count++;
+
+	return SUCCESS;
+}
+
+void block_decoder_init(block_coder_t *dec, block_t *block) {
+	memset(dec, 0, sizeof(block_coder_t));
+
+	dec->block = block;
+}
+
+void block_decode(block_coder_t *dec, reading_t *rd) {
+	if (dec->pos == 0) {
+		dec->time = block_read(dec, 64);
+		dec->value = block_read(dec, 64);
+	}
+	else {
+		int64_t dod;
+
+		if (block_read(dec, 1) == 0) {
+			dod = 0;
+		}
+		else if (block_read(dec, 1) == 0) {
+			dod = block_sign_extend(block_read(dec, 7), 7);
+		}
+		else if (block_read(dec, 1) == 0) {
+			dod = block_sign_extend(block_read(dec, 9), 9);
+		}
+		else if (block_read(dec, 1) == 0) {
+			dod = block_sign_extend(block_read(dec, 12), 12);
+		}
+		else {
+			dod = block_read(dec, 64);
+		}
+
+		dec->delta += dod;
+		dec->time += dec->delta;
+
+		if (block_read(dec, 1) == 1) {
+			if (block_read(dec, 1) == 1) {
+				dec->leading = block_read(dec, 5);
+				dec->trailing = 64 - dec->leading - (block_read(dec, 6) + 1);
+			}
+
+			dec->value ^= block_read(dec, 64 - dec->leading - dec->trailing) << dec->trailing;
+		}
+	}
+
+	memset(rd, 0, sizeof(reading_t));
+	rd->time.tv_sec = dec->time / 1000;
+	rd->time.tv_usec = (dec->time % 1000) * 1000;
+	memcpy(&rd->value, &dec->value, sizeof(rd->value));
+}
@@ -1,5 +1,5 @@
 /**
- * Circular buffer (double linked)
+ * Circular buffer (array based ring)
  *
  * Used to store recent readings and buffer in case of net inconnectivity
  *
@@ -28,91 +28,599 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "buffer.h"
+#include "common.h"
 
-void buffer_init(buffer_t *buf) {
-	pthread_mutex_init(&buf->mutex, NULL);
+#define BUFFER_CAPACITY_MIN 16 /* minimum size of the ring */
 
-	pthread_mutex_lock(&buf->mutex);
-	buf->head = NULL;
-	buf->tail = NULL;
-	buf->sent = NULL;
-	buf->size = 0;
+void buffer_init(buffer_t *buf) {
+	buf->ring = NULL;
+	buf->spill = NULL;
+	buf->spill_head = 0;
+	buf->head = 0;
+	buf->tail = 0;
+	buf->ncursors = 0;
 	buf->keep = 0;
-	pthread_mutex_unlock(&buf->mutex);
+	buf->budget = 0;
+	buf->spilled = 0;
+	buf->overwritten = 0;
 }
 
-reading_t * buffer_push(buffer_t *buf, reading_t *rd) {
-	reading_t *new;
+void buffer_seek(buffer_t *buf, unsigned long seq) {
+	buf->spill_head = seq;
+	buf->head = seq;
+	buf->tail = seq;
+
+	for (int i = 0; i < buf->ncursors; i++) {
+		buf->cursors[i].seq = seq;
+	}
+}
+
+buffer_cursor_t * buffer_cursor(buffer_t *buf, int hold) {
+	if (buf->ncursors == BUFFER_CURSORS_MAX) {
+		return NULL;
+	}
+
+	buffer_cursor_t *cur = &buf->cursors[buf->ncursors++];
+
+	pthread_mutex_init(&cur->mutex, NULL);
+	pthread_cond_init(&cur->condition, NULL);
+
+	cur->seq = buf->tail;
+	cur->hold = hold;
+	cur->waiting = 0;
+	cur->fd = -1;
+
+	return cur;
+}
+
+int buffer_spill(buffer_t *buf, const char *path, size_t size, int compressed) {
+	buffer_spill_t *spill = malloc(sizeof(buffer_spill_t));
+	size_t record = (compressed) ? sizeof(block_t) : sizeof(buffer_spilled_t);
+	void *mem;
+
+	if (spill == NULL) {
+		return ERR; /* cannot allocate memory */
+	}
+
+	spill->compressed = compressed;
+	spill->block_head = 0;
+	spill->block_tail = 0;
+	spill->capacity = 1;
+	while (spill->capacity * 2 * record <= size) {
+		spill->capacity <<= 1; /* round down to power of two */
+	}
+
+	if (path) {
+		int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (fd < 0 || ftruncate(fd, spill->capacity * record) != 0) {
+			print(log_error, "Cannot create spill file %s: %s", NULL, path, strerror(errno));
+			if (fd >= 0) close(fd);
+			free(spill);
+			return ERR;
+		}
+
+		mem = mmap(NULL, spill->capacity * record, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+		close(fd);
+		unlink(path); /* mapping stays valid until munmap() */
+	}
+	else {
+		mem = mmap(NULL, spill->capacity * record, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+
+	if (mem == MAP_FAILED) {
+		print(log_error, "Cannot map spill file %s: %s", NULL, (path) ? path : "(anonymous)", strerror(errno));
+		free(spill);
+		return ERR;
+	}
+
+	spill->readings = mem;
+	buf->spill = spill;
+
+	return SUCCESS;
+}
+
+int buffer_reserve(buffer_t *buf, size_t n) {
+	buffer_ring_t *old = buf->ring;
+	size_t capacity = BUFFER_CAPACITY_MIN;
+
+	if (old && n <= old->capacity) {
+		return SUCCESS; /* nothing to do */
+	}
+
+	while (capacity < n) {
+		capacity <<= 1; /* round up to next power of two */
+	}
+
+	while (buf->budget && capacity > BUFFER_CAPACITY_MIN && capacity * sizeof(reading_t) > buf->budget) {
+		capacity >>= 1; /* stay within budget */
+	}
+
+	if (old && capacity <= old->capacity) {
+		return SUCCESS; /* budget exhausted */
+	}
+
+	buffer_ring_t *ring = malloc(sizeof(buffer_ring_t) + capacity * sizeof(reading_t));
+	if (ring == NULL) {
+		return ERR; /* cannot allocate memory; keep old ring */
+	}
+
+	ring->retired = old;
+	ring->capacity = capacity;
+
+	for (unsigned long seq = buf->head; seq != buf->tail; seq++) {
+		ring->readings[seq & (capacity - 1)] = *buffer_get(buf, seq);
+	}
+
+	/* publish new ring; the old one is kept for concurrent readers */
+	__atomic_store_n(&buf->ring, ring, __ATOMIC_RELEASE);
+
+	return SUCCESS;
+}
+
+/**
+ * Sequence number of the oldest reading which has not been consumed by all holding cursors
+ */
+static unsigned long buffer_consumed(buffer_t *buf) {
+	unsigned long seq = buf->tail;
+
+	for (int i = 0; i < buf->ncursors; i++) {
+		if (buf->cursors[i].hold) {
+			unsigned long pos = __atomic_load_n(&buf->cursors[i].seq, __ATOMIC_ACQUIRE);
+
+			if ((long) (pos - seq) < 0) {
+				seq = pos;
+			}
+		}
+	}
+
+	return seq;
+}
 
-	/* allocate memory for new reading */
-	new = malloc(sizeof(reading_t));
+/**
+ * Sequence number of the oldest reading which has to be retained,
+ * because it is unconsumed or part of the history window for the local interface
+ */
+static unsigned long buffer_retain(buffer_t *buf, unsigned long sent) {
+	unsigned long window = buf->tail - buf->keep;
+
+	return ((long) (sent - window) < 0) ? sent : window;
+}
 
-	/* cannot allocate memory */
-	if (new == NULL) {
-		/* => delete old readings (ring buffer) */
-		if (buf->size > 0) {
-			new = buf->head;
+/**
+ * Move oldest reading to spill tier as fixed size record
+ */
+static void buffer_spill_record(buffer_t *buf, unsigned long sent) {
+	buffer_spill_t *spill = buf->spill;
 
-			pthread_mutex_lock(&buf->mutex);
-			buf->head = new->next;
-			buf->size--;
-			pthread_mutex_unlock(&buf->mutex);
+	if (buf->head - buf->spill_head == spill->capacity) { /* spill is full as well */
+		if ((long) (sent - buf->spill_head) <= 0) {
+			buf->overwritten++;
 		}
-		else { /* giving up :-( */
-			return NULL;
+
+		__atomic_store_n(&buf->spill_head, buf->spill_head + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	reading_t *oldest = buffer_get(buf, buf->head);
+	buffer_spilled_t *spilled = &spill->readings[buf->head & (spill->capacity - 1)];
+
+	spilled->time = (int64_t) oldest->time.tv_sec * 1000000 + oldest->time.tv_usec;
+	spilled->value = oldest->value;
+	buf->spilled++;
+
+	__atomic_store_n(&buf->head, buf->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Move oldest readings to spill tier as compressed block
+ *
+ * Up to half of the ring is compressed at once to fill the block.
+ */
+static void buffer_spill_block(buffer_t *buf, unsigned long sent) {
+	buffer_spill_t *spill = buf->spill;
+	size_t mask = spill->capacity - 1;
+
+	if (spill->block_tail - spill->block_head == spill->capacity) { /* spill is full as well */
+		block_t *oldest = &spill->blocks[spill->block_head & mask];
+		unsigned long end = oldest->seq + oldest->count;
+
+		if ((long) (end - sent) > 0) {
+			buf->overwritten += ((long) (sent - oldest->seq) > 0) ? end - sent : oldest->count;
 		}
+
+		__atomic_store_n(&spill->block_head, spill->block_head + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&buf->spill_head, end, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
 	}
 
-	memcpy(new, rd, sizeof(reading_t));
+	block_t *block = &spill->blocks[spill->block_tail & mask];
+	block_coder_t enc;
+	unsigned long seq = buf->head;
+
+	block_encoder_init(&enc, block, seq);
+	while (seq != buf->tail && seq - buf->head < buf->ring->capacity / 2) {
+		if (block_encode(&enc, buffer_get(buf, seq)) != SUCCESS) {
+			break; /* block is full */
+		}
 
-	pthread_mutex_lock(&buf->mutex);
-	if (buf->size == 0) { /* empty buffer */
-		buf->head = new;
+		seq++;
 	}
-	else {
-		buf->tail->next = new;
+
+	buf->spilled += seq - buf->head;
+
+	/* publish block before removing its readings from the ring */
+	__atomic_store_n(&spill->block_tail, spill->block_tail + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&buf->head, seq, __ATOMIC_RELEASE);
+}
+
+/**
+ * Drop spilled readings before seq
+ *
+ * @param seq must not be beyond the new head of the ring
+ */
+static void buffer_spill_drop(buffer_t *buf, unsigned long seq) {
+	buffer_spill_t *spill = buf->spill;
+	unsigned long spill_head = seq;
+
+	if (spill && spill->compressed) {
+		unsigned long index = spill->block_head;
+
+		/* only complete blocks can be dropped */
+		while (index != spill->block_tail) {
+			block_t *block = &spill->blocks[index & (spill->capacity - 1)];
+
+			if ((long) (block->seq + block->count - spill_head) > 0) {
+				spill_head = block->seq;
+				break;
+			}
+
+			index++;
+		}
+
+		__atomic_store_n(&spill->block_head, index, __ATOMIC_RELEASE);
+	}
+
+	if ((long) (spill_head - buf->spill_head) > 0) {
+		__atomic_store_n(&buf->spill_head, spill_head, __ATOMIC_RELEASE);
+	}
+}
+
+reading_t * buffer_push(buffer_t *buf, reading_t *rd) {
+	reading_t *new;
+
+	if (buf->ring == NULL && buffer_reserve(buf, BUFFER_CAPACITY_MIN) != SUCCESS) {
+		return NULL; /* giving up :-( */
+	}
+
+	if (buf->tail - buf->head == buf->ring->capacity) { /* ring is full => overwrite oldest reading */
+		unsigned long sent = buffer_consumed(buf);
+
+		if ((long) (buffer_retain(buf, sent) - buf->head) > 0 || buf->spill == NULL) {
+			if ((long) (sent - buf->head) <= 0) {
+				buf->overwritten++;
+			}
+
+			/* oldest reading is not needed anymore, so aren't the spilled ones */
+			buffer_spill_drop(buf, buf->head + 1);
+			__atomic_store_n(&buf->head, buf->head + 1, __ATOMIC_RELEASE);
+		}
+		else if (buf->spill->compressed) {
+			buffer_spill_block(buf, sent);
+		}
+		else {
+			buffer_spill_record(buf, sent);
+		}
+
+		/* readers detect overwritten readings by checking head after copying */
+		__atomic_thread_fence(__ATOMIC_RELEASE);
 	}
 
-	new->next = NULL;
+	new = buffer_get(buf, buf->tail);
+	*new = *rd;
 
-	buf->tail = new;
-	buf->size++;
-	pthread_mutex_unlock(&buf->mutex);
+	__atomic_store_n(&buf->tail, buf->tail + 1, __ATOMIC_RELEASE);
 
 	return new;
 }
 
 void buffer_clean(buffer_t *buf) {
-	pthread_mutex_lock(&buf->mutex);
-	while(buf->size > buf->keep && buf->head != buf->sent) {
-		reading_t *pop = buf->head;
+	unsigned long sent = buffer_consumed(buf);
+	unsigned long head = buf->head;
+	unsigned long retain = buffer_retain(buf, sent);
 
-		buf->head = buf->head->next;
-		buf->size--;
+	while (buf->tail - head > buf->keep && (long) (sent - head) > 0) {
+		head++;
+	}
+
+	/* drop spilled readings which are neither unsent nor part of the history */
+	buffer_spill_drop(buf, ((long) (retain - head) > 0) ? head : retain);
+
+	__atomic_store_n(&buf->head, head, __ATOMIC_RELEASE);
+}
+
+void buffer_notify(buffer_t *buf) {
+	/* pairs with the fence in buffer_wait(): either we see the waiter or it sees our tail */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (int i = 0; i < buf->ncursors; i++) {
+		buffer_cursor_t *cur = &buf->cursors[i];
+
+		if (__atomic_load_n(&cur->waiting, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+
+		if (cur->fd >= 0) {
+			__atomic_store_n(&cur->waiting, 0, __ATOMIC_RELAXED);
+
+			if (write(cur->fd, "", 1) < 0 && errno != EAGAIN) {
+				print(log_error, "Cannot notify consumer: %s", NULL, strerror(errno));
+			}
+		}
+		else {
+			pthread_mutex_lock(&cur->mutex);
+			pthread_cond_broadcast(&cur->condition);
+			pthread_mutex_unlock(&cur->mutex);
+		}
+	}
+}
+
+/**
+ * Decode readings out of the compressed spill tier
+ *
+ * The block containing the first reading is located by a binary search
+ * and copied, before it gets decoded.
+ *
+ * @see buffer_read()
+ */
+static size_t buffer_read_blocks(buffer_t *buf, unsigned long *from, unsigned long to, reading_t *rds, size_t n) {
+	buffer_spill_t *spill = buf->spill;
+	size_t mask = spill->capacity - 1;
+	unsigned long start = *from;
+	block_t block;
+
+	while (1) {
+		unsigned long lo = __atomic_load_n(&spill->block_head, __ATOMIC_ACQUIRE);
+		unsigned long hi = __atomic_load_n(&spill->block_tail, __ATOMIC_ACQUIRE);
+
+		if (lo == hi) { /* all blocks have been dropped meanwhile */
+			*from = __atomic_load_n(&buf->spill_head, __ATOMIC_ACQUIRE);
+			return 0;
+		}
+
+		/* find the last block starting not after start */
+		while (hi - lo > 1) {
+			unsigned long mid = lo + (hi - lo) / 2;
+
+			if ((long) (spill->blocks[mid & mask].seq - start) <= 0) {
+				lo = mid;
+			}
+			else {
+				hi = mid;
+			}
+		}
+
+		memcpy(&block, &spill->blocks[lo & mask], sizeof(block_t));
+
+		/* check if the producer has overwritten the block while copying */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if ((long) (__atomic_load_n(&spill->block_head, __ATOMIC_RELAXED) - lo) <= 0) {
+			break;
+		}
+
+		unsigned long spill_head = __atomic_load_n(&buf->spill_head, __ATOMIC_ACQUIRE);
+		if ((long) (spill_head - start) > 0) {
+			start = spill_head;
+		}
+	}
+
+	block_coder_t dec;
+	unsigned long seq = block.seq;
+	size_t count = 0;
+
+	if ((long) (start - seq) < 0) {
+		start = seq;
+	}
+
+	block_decoder_init(&dec, &block);
+	for (unsigned int i = 0; i < block.count && count < n && (long) (to - seq) > 0; i++, seq++) {
+		block_decode(&dec, &rds[count]);
+
+		if ((long) (seq - start) >= 0) {
+			count++;
+		}
+	}
+
+	*from = start;
+
+	return count;
+}
+
+/**
+ * Copy readings out of the spill tier
+ *
+ * @see buffer_read()
+ */
+static size_t buffer_read_spill(buffer_t *buf, unsigned long *from, unsigned long to, reading_t *rds, size_t n) {
+	buffer_spill_t *spill = buf->spill;
+	unsigned long start = *from;
+	size_t count = (to - start < n) ? to - start : n;
+
+	if (spill->compressed) {
+		return buffer_read_blocks(buf, from, to, rds, n);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		buffer_spilled_t *spilled = &spill->readings[(start + i) & (spill->capacity - 1)];
+
+		memset(&rds[i], 0, sizeof(reading_t));
+		rds[i].time.tv_sec = spilled->time / 1000000;
+		rds[i].time.tv_usec = spilled->time % 1000000;
+		rds[i].value = spilled->value;
+	}
+
+	/* check if the producer has overwritten spilled readings while copying */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	unsigned long spill_head = __atomic_load_n(&buf->spill_head, __ATOMIC_RELAXED);
+
+	if ((long) (spill_head - start) > 0) {
+		size_t lost = spill_head - start;
+
+		if (lost >= count) {
+			lost = count;
+		}
 
-		free(pop);
+		memmove(rds, rds + lost, (count - lost) * sizeof(reading_t));
+		count -= lost;
+		start += lost;
 	}
-	pthread_mutex_unlock(&buf->mutex);
+
+	*from = start;
+
+	return count;
+}
+
+size_t buffer_read(buffer_t *buf, unsigned long *from, unsigned long to, reading_t *rds, size_t n) {
+	unsigned long tail = __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE);
+	unsigned long head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+	unsigned long spill_head = __atomic_load_n(&buf->spill_head, __ATOMIC_ACQUIRE);
+	buffer_ring_t *ring = __atomic_load_n(&buf->ring, __ATOMIC_ACQUIRE); /* after tail! */
+	unsigned long start = *from;
+	size_t count = 0;
+
+	if ((long) (spill_head - start) > 0) {
+		start = spill_head;
+	}
+
+	if ((long) (tail - to) < 0) {
+		to = tail;
+	}
+
+	if ((long) (head - start) > 0 && (long) (to - start) > 0) { /* reading has been spilled */
+		*from = start;
+
+		return buffer_read_spill(buf, from, ((long) (to - head) > 0) ? head : to, rds, n);
+	}
+	else if ((long) (to - start) > 0) {
+		size_t mask = ring->capacity - 1;
+
+		count = (to - start < n) ? to - start : n;
+
+		/* copy in up to two contiguous chunks */
+		size_t first = ring->capacity - (start & mask);
+		if (first > count) {
+			first = count;
+		}
+
+		memcpy(rds, &ring->readings[start & mask], first * sizeof(reading_t));
+		memcpy(rds + first, &ring->readings[0], (count - first) * sizeof(reading_t));
+
+		/* check if the producer has overwritten readings while copying */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&buf->head, __ATOMIC_RELAXED);
+
+		if ((long) (head - start) > 0) {
+			size_t lost = head - start;
+
+			if (lost >= count) {
+				lost = count;
+			}
+
+			memmove(rds, rds + lost, (count - lost) * sizeof(reading_t));
+			count -= lost;
+			start += lost;
+		}
+	}
+
+	*from = start;
+
+	return count;
+}
+
+unsigned long buffer_search(buffer_t *buf, unsigned long from, unsigned long to, struct timeval tv) {
+	unsigned long lo = from, hi = to;
+
+	while ((long) (hi - lo) > 0) {
+		unsigned long mid = lo + (hi - lo) / 2;
+		unsigned long seq = mid;
+		reading_t rd;
+
+		/* overwritten or dropped readings are older anyway */
+		if (buffer_read(buf, &seq, mid + 1, &rd, 1) == 0 || seq != mid || !timercmp(&rd.time, &tv, >)) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+void buffer_advance(buffer_cursor_t *cur, unsigned long seq) {
+	__atomic_store_n(&cur->seq, seq, __ATOMIC_RELEASE);
+}
+
+static void buffer_wait_cleanup(void *arg) {
+	buffer_cursor_t *cur = (buffer_cursor_t *) arg;
+
+	__atomic_sub_fetch(&cur->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&cur->mutex);
+}
+
+int buffer_wait(buffer_t *buf, buffer_cursor_t *cur, unsigned long seq, const struct timespec *abstime) {
+	int ret = 0;
+
+	pthread_mutex_lock(&cur->mutex);
+	pthread_cleanup_push(&buffer_wait_cleanup, cur);
+
+	__atomic_add_fetch(&cur->waiting, 1, __ATOMIC_SEQ_CST);
+
+	while (__atomic_load_n(&buf->tail, __ATOMIC_SEQ_CST) == seq && ret == 0) { /* detect spurious wakeups */
+		ret = (abstime) ? pthread_cond_timedwait(&cur->condition, &cur->mutex, abstime)
+				: pthread_cond_wait(&cur->condition, &cur->mutex);
+	}
+
+	pthread_cleanup_pop(1);
+
+	return (ret == 0) ? SUCCESS : ERR;
+}
+
+int buffer_poll(buffer_t *buf, buffer_cursor_t *cur) {
+	__atomic_store_n(&cur->waiting, 1, __ATOMIC_SEQ_CST);
+
+	/* pairs with the fence in buffer_notify(): either we see the new tail or it sees us waiting */
+	if (__atomic_load_n(&buf->tail, __ATOMIC_SEQ_CST) != cur->seq) {
+		__atomic_store_n(&cur->waiting, 0, __ATOMIC_RELAXED);
+		return TRUE;
+	}
+
+	return FALSE;
 }
 
 char * buffer_dump(buffer_t *buf, char *dump, size_t len) {
+	unsigned long sent = buffer_consumed(buf);
 	size_t pos = 0;
 	dump[pos++] = '{';
 
-	for (reading_t *rd = buf->head; rd != NULL; rd = rd->next) {
+	for (unsigned long seq = buf->head; seq != buf->tail; seq++) {
 		if (pos < len) {
-			pos += snprintf(dump+pos, len-pos, "%.2f", rd->value);
+			pos += snprintf(dump+pos, len-pos, "%.2f", buffer_get(buf, seq)->value);
 		}
 
-		/* indicate last sent reading */
-		if (pos < len && buf->sent == rd) {
+		/* indicate first unconsumed reading */
+		if (pos < len && sent == seq) {
 			dump[pos++] = '!';
 		}
 
 		/* add seperator between values */
-		if (pos < len && rd->next != NULL) {
+		if (pos < len && seq + 1 != buf->tail) {
 			dump[pos++] = ',';
 		}
 	}
@@ -126,18 +634,29 @@ char * buffer_dump(buffer_t *buf, char *dump, size_t len) {
 }
 
 void buffer_free(buffer_t *buf) {
-	pthread_mutex_destroy(&buf->mutex);
+	for (int i = 0; i < buf->ncursors; i++) {
+		pthread_mutex_destroy(&buf->cursors[i].mutex);
+		pthread_cond_destroy(&buf->cursors[i].condition);
+	}
+
+	if (buf->spill) {
+		size_t record = (buf->spill->compressed) ? sizeof(block_t) : sizeof(buffer_spilled_t);
 
-	reading_t *rd = buf->head;
-	if (rd)	do {
-		reading_t *tmp = rd;
-		rd = rd->next;
+		munmap(buf->spill->readings, buf->spill->capacity * record);
+		free(buf->spill);
+		buf->spill = NULL;
+	}
+
+	buffer_ring_t *ring = buf->ring;
+	while (ring) {
+		buffer_ring_t *tmp = ring;
+		ring = ring->retired;
 		free(tmp);
-	} while (rd);
+	}
 
-	buf->head = NULL;
-	buf->tail = NULL;
-	buf->sent = NULL;
-	buf->size = 0;
+	buf->ring = NULL;
+	buf->head = 0;
+	buf->tail = 0;
+	buf->ncursors = 0;
 	buf->keep = 0;
 }
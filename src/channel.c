@@ -27,20 +27,191 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include "channel.h"
 
-void channel_init(channel_t *ch, const char *uuid, const char *middleware, reading_id_t identifier) {
+/**
+ * FNV-1a hash of a string
+ */
+static size_t channel_hash(const char *str) {
+	uint32_t hash = 2166136261u;
+
+	for (const unsigned char *p = (const unsigned char *) str; *p; p++) {
+		hash = (hash ^ *p) * 16777619u;
+	}
+
+	return hash;
+}
+
+int channel_index_init(channel_index_t *idx, list_t *mappings) {
+	size_t count = 0;
+
+	foreach(*mappings, mapping, map_t) {
+		count += mapping->channels.size;
+	}
+
+	for (idx->size = 16; idx->size < 2 * count; idx->size *= 2);
+
+	idx->count = 0;
+	idx->table = calloc(idx->size, sizeof(channel_t *));
+	if (idx->table == NULL) {
+		print(log_error, "Cannot allocate memory", NULL);
+		return ERR;
+	}
+
+	foreach(*mappings, mapping, map_t) {
+		foreach(mapping->channels, ch, channel_t) {
+			size_t slot = channel_hash(ch->uuid) & (idx->size - 1);
+
+			ch->index = idx->count++;
+
+			while (idx->table[slot] && strcmp(idx->table[slot]->uuid, ch->uuid) != 0) {
+				slot = (slot + 1) & (idx->size - 1);
+			}
+
+			if (idx->table[slot]) {
+				print(log_error, "Duplicate UUID %s, only the first channel is accessible by UUID", ch, ch->uuid);
+				continue;
+			}
+
+			idx->table[slot] = ch;
+		}
+	}
+
+	return SUCCESS;
+}
+
+void channel_index_free(channel_index_t *idx) {
+	free(idx->table);
+	idx->table = NULL;
+	idx->size = 0;
+	idx->count = 0;
+}
+
+channel_t * channel_index_lookup(channel_index_t *idx, const char *uuid) {
+	if (idx->table == NULL) {
+		return NULL;
+	}
+
+	for (size_t slot = channel_hash(uuid) & (idx->size - 1); idx->table[slot]; slot = (slot + 1) & (idx->size - 1)) {
+		if (strcmp(idx->table[slot]->uuid, uuid) == 0) {
+			return idx->table[slot];
+		}
+	}
+
+	return NULL;
+}
+
+void channel_init(channel_t *ch, const char *uuid, reading_id_t identifier) {
 	static int instances; /* static to generate channel ids */
 	snprintf(ch->id, 5, "ch%i", instances++);
 
 	ch->identifier = identifier;
 
 	ch->uuid = strdup(uuid);
-	ch->middleware = strdup(middleware);
+	ch->nsinks = 0;
+	ch->index = 0;
+
+	buffer_init(&ch->buffer); /* initialize buffer and thread syncronization helpers */
+	ch->spool = NULL;
+	ch->local = NULL;
+	ch->version = 0;
+	aggregate_init(&ch->aggregate);
+
+	/* global defaults are applied after parsing the configuration */
+	ch->batch_max_tuples = 0;
+	ch->batch_max_delay = -1;
+}
 
-	buffer_init(&ch->buffer); /* initialize buffer */
-	pthread_cond_init(&ch->condition, NULL); /* initialize thread syncronization helpers */
+int channel_add_sink(channel_t *ch, const char *middleware) {
+	if (ch->nsinks == CHANNEL_SINKS_MAX) {
+		print(log_error, "Too many middlewares, only %i are supported", ch, CHANNEL_SINKS_MAX);
+		return ERR;
+	}
+
+	for (size_t i = 0; i < ch->nsinks; i++) {
+		if (strcmp(ch->sinks[i].middleware, middleware) == 0) {
+			print(log_error, "Duplicate middleware: %s", ch, middleware);
+			return ERR;
+		}
+	}
+
+	channel_sink_t *sink = &ch->sinks[ch->nsinks++];
+
+	sink->middleware = strdup(middleware);
+	sink->cursor = NULL;
+
+	return SUCCESS;
+}
+
+void channel_ack(channel_t *ch, channel_sink_t *sink, unsigned long seq) {
+	buffer_advance(sink->cursor, seq);
+
+	if (ch->spool) {
+		unsigned long acked = seq;
+
+		for (size_t i = 0; i < ch->nsinks; i++) {
+			unsigned long cur = __atomic_load_n(&ch->sinks[i].cursor->seq, __ATOMIC_ACQUIRE);
+
+			if ((long) (cur - acked) < 0) {
+				acked = cur;
+			}
+		}
+
+		spool_ack(ch->spool, acked);
+	}
+}
+
+int channel_spill(channel_t *ch, const char *path, size_t size, int compressed) {
+	if (path == NULL) { /* anonymous memory */
+		return buffer_spill(&ch->buffer, NULL, size, compressed);
+	}
+
+	char *file = malloc(strlen(path) + strlen(ch->uuid) + 8);
+	if (file == NULL) {
+		return ERR;
+	}
+
+	sprintf(file, "%s/%s.spill", path, ch->uuid);
+
+	int ret = buffer_spill(&ch->buffer, file, size, compressed);
+	free(file);
+
+	return ret;
+}
+
+int channel_spool(channel_t *ch, const char *path, size_t max, int sync) {
+	char *dir = malloc(strlen(path) + strlen(ch->uuid) + 2);
+	if (dir == NULL) {
+		return ERR;
+	}
+
+	sprintf(dir, "%s/%s", path, ch->uuid);
+
+	ch->spool = malloc(sizeof(spool_t));
+	if (ch->spool == NULL) {
+		free(dir);
+		return ERR;
+	}
+
+	if (spool_open(ch->spool, dir, max, sync) != SUCCESS) {
+		spool_close(ch->spool);
+		free(ch->spool);
+		free(dir);
+		ch->spool = NULL;
+		return ERR;
+	}
+
+	free(dir);
+
+	/* continue numbering after the spooled readings and queue unsent ones */
+	buffer_seek(&ch->buffer, ch->spool->next);
+	for (size_t i = 0; i < ch->nsinks; i++) {
+		buffer_advance(ch->sinks[i].cursor, ch->spool->acked);
+	}
+
+	return SUCCESS;
 }
 
 /**
@@ -48,9 +219,17 @@ void channel_init(channel_t *ch, const char *uuid, const char *middleware, readi
  */
 void channel_free(channel_t *ch) {
 	buffer_free(&ch->buffer);
-	pthread_cond_destroy(&ch->condition);
+	aggregate_free(&ch->aggregate);
+
+	if (ch->spool) {
+		spool_close(ch->spool);
+		free(ch->spool);
+	}
+
+	for (size_t i = 0; i < ch->nsinks; i++) {
+		free(ch->sinks[i].middleware);
+	}
 
 	free(ch->uuid);
-	free(ch->middleware);
 }
 
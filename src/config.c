@@ -32,7 +32,7 @@
 
 static const char *option_type_str[] = { "null", "boolean", "double", "int", "object", "array", "string" };
 
-int config_parse(const char *filename, list_t *mappings, config_options_t *options) {
+int config_parse(const char *filename, list_t *mappings, channel_index_t *index, config_options_t *options) {
 	struct json_object *json_cfg = NULL;
 	struct json_tokener *json_tok = json_tokener_new();
 
@@ -81,9 +81,106 @@ int config_parse(const char *filename, list_t *mappings, config_options_t *optio
 		else if (strcmp(key, "retry") == 0 && type == json_type_int) {
 			options->retry_pause = json_object_get_int(value);
 		}
+		else if (strcmp(key, "retry_max") == 0 && type == json_type_int) {
+			options->retry_max = json_object_get_int(value);
+		}
+		else if (strcmp(key, "batch_max_tuples") == 0 && type == json_type_int) {
+			options->batch_max_tuples = json_object_get_int(value);
+		}
+		else if (strcmp(key, "batch_max_delay") == 0 && type == json_type_int) {
+			options->batch_max_delay = json_object_get_int(value);
+		}
+		else if (strcmp(key, "connections") == 0 && type == json_type_int) {
+			options->connections = json_object_get_int(value);
+		}
+		else if (strcmp(key, "headroom") == 0 && type == json_type_int) {
+			options->buffer_headroom = json_object_get_int(value);
+		}
 		else if (strcmp(key, "verbosity") == 0 && type == json_type_int) {
 			options->verbosity = json_object_get_int(value);
 		}
+		else if (strcmp(key, "coalesce") == 0) {
+			json_object_object_foreach(value, key, coalesce_value) {
+				enum json_type coalesce_type = json_object_get_type(coalesce_value);
+
+				if (strcmp(key, "enabled") == 0 && coalesce_type == json_type_boolean) {
+					options->coalesce = json_object_get_boolean(coalesce_value);
+				}
+				else if (strcmp(key, "tuples") == 0 && coalesce_type == json_type_int) {
+					int tuples = json_object_get_int(coalesce_value);
+
+					if (tuples <= 0) {
+						print(log_error, "Invalid number of coalesced tuples: %i", NULL, tuples);
+						return ERR;
+					}
+
+					options->coalesce_tuples = tuples;
+				}
+				else if (strcmp(key, "delay") == 0 && coalesce_type == json_type_int) {
+					options->coalesce_delay = json_object_get_int(coalesce_value);
+				}
+				else {
+					print(log_error, "Ignoring invalid field or type: %s=%s (%s)",
+						NULL, key, json_object_get_string(coalesce_value), option_type_str[coalesce_type]);
+				}
+			}
+		}
+		else if (strcmp(key, "chunk") == 0) {
+			json_object_object_foreach(value, key, chunk_value) {
+				enum json_type chunk_type = json_object_get_type(chunk_value);
+
+				if (strcmp(key, "tuples") == 0 && chunk_type == json_type_int) {
+					int tuples = json_object_get_int(chunk_value);
+
+					if (tuples <= 0) {
+						print(log_error, "Invalid number of tuples per chunk: %i", NULL, tuples);
+						return ERR;
+					}
+
+					options->chunk_tuples = tuples;
+				}
+				else if (strcmp(key, "bytes") == 0 && chunk_type == json_type_int) {
+					int bytes = json_object_get_int(chunk_value);
+
+					if (bytes <= 0) {
+						print(log_error, "Invalid number of bytes per chunk: %i", NULL, bytes);
+						return ERR;
+					}
+
+					options->chunk_bytes = bytes;
+				}
+				else {
+					print(log_error, "Ignoring invalid field or type: %s=%s (%s)",
+						NULL, key, json_object_get_string(chunk_value), option_type_str[chunk_type]);
+				}
+			}
+		}
+		else if (strcmp(key, "compression") == 0) {
+			json_object_object_foreach(value, key, compression_value) {
+				enum json_type compression_type = json_object_get_type(compression_value);
+
+				if (strcmp(key, "enabled") == 0 && compression_type == json_type_boolean) {
+					options->compress = json_object_get_boolean(compression_value);
+				}
+				else if (strcmp(key, "level") == 0 && compression_type == json_type_int) {
+					int level = json_object_get_int(compression_value);
+
+					if (level < 1 || level > 9) {
+						print(log_error, "Invalid compression level: %i (must be between 1 and 9)", NULL, level);
+						return ERR;
+					}
+
+					options->compress_level = level;
+				}
+				else if (strcmp(key, "threshold") == 0 && compression_type == json_type_int) {
+					options->compress_threshold = json_object_get_int(compression_value);
+				}
+				else {
+					print(log_error, "Ignoring invalid field or type: %s=%s (%s)",
+						NULL, key, json_object_get_string(compression_value), option_type_str[compression_type]);
+				}
+			}
+		}
 		else if (strcmp(key, "local") == 0) {
 			json_object_object_foreach(value, key, local_value) {
 				enum json_type local_type = json_object_get_type(local_value);
@@ -94,6 +191,9 @@ int config_parse(const char *filename, list_t *mappings, config_options_t *optio
 				else if (strcmp(key, "port") == 0 && local_type == json_type_int) {
 					options->port = json_object_get_int(local_value);
 				}
+				else if (strcmp(key, "threads") == 0 && local_type == json_type_int) {
+					options->local_threads = json_object_get_int(local_value);
+				}
 				else if (strcmp(key, "timeout") == 0 && local_type == json_type_int) {
 					options->comet_timeout = json_object_get_int(local_value);
 				}
@@ -109,6 +209,50 @@ int config_parse(const char *filename, list_t *mappings, config_options_t *optio
 				}
 			}
 		}
+		else if (strcmp(key, "memory") == 0) {
+			json_object_object_foreach(value, key, memory_value) {
+				enum json_type memory_type = json_object_get_type(memory_value);
+
+				if (strcmp(key, "channel") == 0 && memory_type == json_type_int) {
+					options->memory_channel = json_object_get_int(memory_value);
+				}
+				else if (strcmp(key, "total") == 0 && memory_type == json_type_int) {
+					options->memory_total = json_object_get_int(memory_value);
+				}
+				else if (strcmp(key, "spill") == 0 && memory_type == json_type_string) {
+					options->spill = strdup(json_object_get_string(memory_value));
+				}
+				else if (strcmp(key, "spill_size") == 0 && memory_type == json_type_int) {
+					options->spill_size = json_object_get_int(memory_value);
+				}
+				else if (strcmp(key, "compress") == 0 && memory_type == json_type_boolean) {
+					options->memory_compress = json_object_get_boolean(memory_value);
+				}
+				else {
+					print(log_error, "Ignoring invalid field or type: %s=%s (%s)",
+						NULL, key, json_object_get_string(memory_value), option_type_str[memory_type]);
+				}
+			}
+		}
+		else if (strcmp(key, "spool") == 0) {
+			json_object_object_foreach(value, key, spool_value) {
+				enum json_type spool_type = json_object_get_type(spool_value);
+
+				if (strcmp(key, "path") == 0 && spool_type == json_type_string) {
+					options->spool = strdup(json_object_get_string(spool_value));
+				}
+				else if (strcmp(key, "max") == 0 && spool_type == json_type_int) {
+					options->spool_max = json_object_get_int(spool_value);
+				}
+				else if (strcmp(key, "sync") == 0 && spool_type == json_type_int) {
+					options->spool_sync = json_object_get_int(spool_value);
+				}
+				else {
+					print(log_error, "Ignoring invalid field or type: %s=%s (%s)",
+						NULL, key, json_object_get_string(spool_value), option_type_str[spool_type]);
+				}
+			}
+		}
 		else if ((strcmp(key, "sensors") == 0 || strcmp(key, "meters") == 0) && type == json_type_array) {
 			int len = json_object_array_length(value);
 			for (int i = 0; i < len; i++) {
@@ -128,7 +272,10 @@ int config_parse(const char *filename, list_t *mappings, config_options_t *optio
 
 	json_object_put(json_cfg); /* free allocated memory */
 
-	return SUCCESS;
+	/* index channels by UUID for the local interface */
+	channel_index_free(index);
+
+	return channel_index_init(index, mappings);
 }
 
 map_t * config_parse_meter(struct json_object *jso) {
@@ -193,8 +340,10 @@ map_t * config_parse_meter(struct json_object *jso) {
 
 channel_t * config_parse_channel(struct json_object *jso, meter_protocol_t protocol) {
 	const char *uuid = NULL;
-	const char *middleware = NULL;
+	struct json_object *middleware = NULL;
 	const char *id_str = NULL;
+	int batch_max_tuples = 0;
+	int batch_max_delay = -1;
 
 	json_object_object_foreach(jso, key, value) {
 		enum json_type type = json_object_get_type(value);
@@ -202,12 +351,18 @@ channel_t * config_parse_channel(struct json_object *jso, meter_protocol_t proto
 		if (strcmp(key, "uuid") == 0 && type == json_type_string) {
 			uuid = json_object_get_string(value);
 		}
-		else if (strcmp(key, "middleware") == 0 && type == json_type_string) {
-			middleware = json_object_get_string(value);
+		else if (strcmp(key, "middleware") == 0 && (type == json_type_string || type == json_type_array)) {
+			middleware = value; /* a single url or a list of urls */
 		}
 		else if (strcmp(key, "identifier") == 0 && type == json_type_string) {
 			id_str = json_object_get_string(value);
 		}
+		else if (strcmp(key, "batch_max_tuples") == 0 && type == json_type_int) {
+			batch_max_tuples = json_object_get_int(value);
+		}
+		else if (strcmp(key, "batch_max_delay") == 0 && type == json_type_int) {
+			batch_max_delay = json_object_get_int(value);
+		}
 		else {
 			print(log_error, "Ignoring invalid field or type: %s=%s (%s)",
 				NULL, key, json_object_get_string(value), option_type_str[type]);
@@ -236,8 +391,40 @@ channel_t * config_parse_channel(struct json_object *jso, meter_protocol_t proto
 	}
 
 	channel_t *ch = malloc(sizeof(channel_t));
-	channel_init(ch, uuid, middleware, id);
-	print(log_info, "New channel initialized (uuid=...%s middleware=%s id=%s)", ch, uuid+30, middleware, (id_str) ? id_str : "(none)");
+	channel_init(ch, uuid, id);
+	ch->batch_max_tuples = batch_max_tuples;
+	ch->batch_max_delay = batch_max_delay;
+
+	/* add sinks */
+	int ret = SUCCESS;
+	if (json_object_get_type(middleware) == json_type_string) {
+		ret = channel_add_sink(ch, json_object_get_string(middleware));
+	}
+	else for (int i = 0; i < json_object_array_length(middleware) && ret == SUCCESS; i++) {
+		struct json_object *url = json_object_array_get_idx(middleware, i);
+
+		if (json_object_get_type(url) != json_type_string) {
+			print(log_error, "Invalid middleware: %s", NULL, json_object_get_string(url));
+			ret = ERR;
+		}
+		else {
+			ret = channel_add_sink(ch, json_object_get_string(url));
+		}
+	}
+
+	if (ret == SUCCESS && ch->nsinks == 0) { /* empty list */
+		print(log_error, "Missing middleware", NULL);
+		ret = ERR;
+	}
+
+	if (ret != SUCCESS) {
+		channel_free(ch);
+		free(ch);
+		return NULL;
+	}
+
+	print(log_info, "New channel initialized (uuid=...%s middleware=%s%s id=%s)", ch, uuid+30,
+		ch->sinks[0].middleware, (ch->nsinks > 1) ? ",..." : "", (id_str) ? id_str : "(none)");
 
 	return ch;
 }
@@ -0,0 +1,192 @@
+/**
+ * Routing of readings to the channels of a meter
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "dispatch.h"
+#include "channel.h"
+
+/**
+ * Get the mask of the OBIS groups which are no wildcards
+ *
+ * Identifiers of other protocols have no wildcards.
+ */
+static uint64_t dispatch_mask(dispatch_t *d, reading_id_t id) {
+	if (d->protocol == meter_protocol_d0 || d->protocol == meter_protocol_sml) {
+		return obis_mask(id.obis);
+	}
+
+	return ~0ULL;
+}
+
+/**
+ * Get the key of an identifier with the wildcards of a group masked out
+ */
+static unsigned long long dispatch_key(dispatch_t *d, reading_id_t id, uint64_t mask) {
+	switch (d->protocol) {
+		case meter_protocol_d0:
+		case meter_protocol_sml:
+			return id.obis.packed & mask;
+
+		case meter_protocol_fluksov2:
+			return (unsigned int) id.channel;
+
+		default:
+			/* string identifiers are unique in the registry */
+			return (uintptr_t) id.string;
+	}
+}
+
+static size_t dispatch_slot(dispatch_group_t *group, unsigned long long key) {
+	return ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (group->size - 1);
+}
+
+int dispatch_init(dispatch_t *d, meter_protocol_t protocol, list_t *channels) {
+	size_t i = 0;
+
+	d->protocol = protocol;
+	d->groups = NULL;
+	d->ngroups = 0;
+	d->nchannels = channels->size;
+	d->channels = malloc(d->nchannels * sizeof(channel_t *));
+	d->matches = malloc(d->nchannels * sizeof(channel_t *));
+
+	switch (protocol) {
+		case meter_protocol_d0:
+		case meter_protocol_sml:
+		case meter_protocol_fluksov2:
+		case meter_protocol_file:
+		case meter_protocol_exec:
+			d->all = FALSE;
+			break;
+
+		default:
+			d->all = TRUE;
+	}
+
+	if (d->nchannels == 0) {
+		return SUCCESS;
+	}
+
+	/* every group gets room for all channels, there are only a few of them */
+	d->groups = malloc(d->nchannels * sizeof(dispatch_group_t));
+
+	if (d->channels == NULL || d->matches == NULL || d->groups == NULL) {
+		return ERR;
+	}
+
+	foreach(*channels, ch, channel_t) {
+		uint64_t mask = dispatch_mask(d, ch->identifier);
+		dispatch_group_t *group = NULL;
+
+		d->channels[i++] = ch;
+
+		for (size_t j = 0; j < d->ngroups; j++) {
+			if (d->groups[j].mask == mask) {
+				group = &d->groups[j];
+				break;
+			}
+		}
+
+		if (group == NULL) {
+			group = &d->groups[d->ngroups++];
+
+			group->mask = mask;
+			group->count = 0;
+			group->entries = malloc(d->nchannels * sizeof(dispatch_entry_t));
+
+			/* at most half full */
+			for (group->size = 8; group->size < 2 * d->nchannels; group->size *= 2);
+			group->slots = malloc(group->size * sizeof(int));
+
+			if (group->entries == NULL || group->slots == NULL) {
+				return ERR;
+			}
+
+			for (size_t k = 0; k < group->size; k++) {
+				group->slots[k] = -1;
+			}
+		}
+
+		dispatch_entry_t *entry = &group->entries[group->count];
+		size_t slot;
+
+		entry->key = dispatch_key(d, ch->identifier, mask);
+		entry->ch = ch;
+
+		slot = dispatch_slot(group, entry->key);
+		entry->next = group->slots[slot];
+		group->slots[slot] = group->count++;
+	}
+
+	return SUCCESS;
+}
+
+void dispatch_free(dispatch_t *d) {
+	for (size_t j = 0; j < d->ngroups; j++) {
+		free(d->groups[j].entries);
+		free(d->groups[j].slots);
+	}
+
+	free(d->groups);
+	free(d->channels);
+	free(d->matches);
+}
+
+channel_t ** dispatch_lookup(dispatch_t *d, reading_id_t id, size_t *n) {
+	uint64_t mask = dispatch_mask(d, id);
+
+	if (d->all) {
+		*n = d->nchannels;
+		return d->channels;
+	}
+
+	*n = 0;
+
+	for (size_t j = 0; j < d->ngroups; j++) {
+		dispatch_group_t *group = &d->groups[j];
+
+		/* the wildcards of the reading are wildcards of the patterns as well */
+		if ((group->mask & ~mask) == 0) {
+			unsigned long long key = dispatch_key(d, id, group->mask);
+
+			for (int e = group->slots[dispatch_slot(group, key)]; e >= 0; e = group->entries[e].next) {
+				if (group->entries[e].key == key) {
+					d->matches[(*n)++] = group->entries[e].ch;
+				}
+			}
+		}
+		else { /* the reading has wildcards of its own: compare one by one */
+			for (size_t e = 0; e < group->count; e++) {
+				if (reading_id_compare(d->protocol, id, group->entries[e].ch->identifier) == 0) {
+					d->matches[(*n)++] = group->entries[e].ch;
+				}
+			}
+		}
+	}
+
+	return d->matches;
+}
@@ -26,98 +26,1015 @@
 #include <json/json.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
 
 #include "vzlogger.h"
 #include "channel.h"
 #include "local.h"
+#include "aggregate.h"
 #include "api.h"
 
 extern config_options_t options;
 
+/* representations of the response document */
+enum {
+	LOCAL_JSON,
+	LOCAL_CBOR
+};
+
+/**
+ * Parameters of a request for channel data
+ */
+typedef struct {
+	long long since;	/* in milliseconds; 0 for the whole history window */
+	size_t limit;		/* maximum number of tuples; 0 for all */
+	int aggregate;		/* bitmask of aggregate types instead of tuples; 0 for tuples */
+	int window;		/* in seconds; aggregate the readings of this period */
+} local_query_t;
+
+/**
+ * Current time in milliseconds
+ */
+static long long local_now() {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * Get the sequence number of the first reading in the history window
+ */
+static unsigned long local_window(local_channel_t *lch, unsigned long tail) {
+	buffer_t *buf = &lch->ch->buffer;
+
+	/* history window may reach into the spill tier */
+	return (buf->keep) ? tail - buf->keep : buf->head;
+}
+
+/**
+ * Append the properties of a channel to an unterminated JSON object
+ */
+static void local_channel_head(local_channel_t *lch, api_buffer_t *json) {
+	channel_t *ch = lch->ch;
+
+	api_buffer_append(json, "{\"uuid\":", 8);
+	api_json_string(json, ch->uuid);
+	api_buffer_append(json, ",\"middleware\":", 14);
+	api_json_string(json, ch->sinks[0].middleware);
+	api_buffer_append(json, ",\"last\":", 8);
+	api_json_double(json, ch->last.value);
+	api_buffer_append(json, ",\"interval\":", 12);
+	api_json_int(json, lch->mapping->meter.interval);
+	api_buffer_append(json, ",\"protocol\":", 12);
+	api_json_string(json, meter_get_details(lch->mapping->meter.protocol)->name);
+}
+
+/**
+ * Append JSON object of a channel with the tuples [from, to)
+ */
+static void local_channel_json(local_channel_t *lch, api_buffer_t *json, unsigned long from, unsigned long to) {
+	local_channel_head(lch, json);
+	api_buffer_append(json, ",\"tuples\":", 10);
+	api_json_tuples(json, &lch->ch->buffer, from, to, (size_t) -1);
+	api_buffer_append(json, "}", 1);
+}
+
+/**
+ * Append JSON object of a channel with the requested aggregates of its window
+ *
+ * Aggregates are taken from the running aggregates, the buffer is not touched.
+ */
+static void local_channel_aggregate(local_channel_t *lch, api_buffer_t *json, const local_query_t *query) {
+	double values[AGGREGATE_TYPES];
+	int first = TRUE;
+
+	aggregate_query(&lch->ch->aggregate, local_now() - query->window * 1000LL, values);
+
+	local_channel_head(lch, json);
+	api_buffer_append(json, ",\"window\":", 10);
+	api_json_int(json, query->window);
+	api_buffer_append(json, ",\"aggregate\":{", 14);
+
+	for (int type = 0; type < AGGREGATE_TYPES; type++) {
+		if (query->aggregate & (1 << type)) {
+			if (!first) {
+				api_buffer_append(json, ",", 1);
+			}
+			first = FALSE;
+
+			api_json_string(json, aggregate_name(type));
+			api_buffer_append(json, ":", 1);
+
+			if (type == AGGREGATE_COUNT) {
+				api_json_int(json, values[type]);
+			}
+			else {
+				api_json_double(json, values[type]);
+			}
+		}
+	}
+
+	api_buffer_append(json, "}}", 2);
+}
+
+/**
+ * Append the snapshot of a channel, rebuild it if new readings have arrived
+ */
+static void local_snapshot(local_channel_t *lch, api_buffer_t *json) {
+	channel_t *ch = lch->ch;
+	api_buffer_t *snapshot = &lch->json;
+
+	pthread_mutex_lock(&lch->mutex);
+
+	unsigned long tail = buffer_tail(&ch->buffer);
+
+	if (!lch->valid || lch->tail != tail) {
+		api_buffer_clear(snapshot);
+		local_channel_json(lch, snapshot, local_window(lch, tail), tail);
+
+		buffer_advance(ch->local, tail);
+		lch->tail = tail;
+		lch->valid = TRUE;
+	}
+
+	api_buffer_append(json, snapshot->data, snapshot->length);
+
+	pthread_mutex_unlock(&lch->mutex);
+}
+
+/**
+ * Get the range [from, to) of the tuples of a channel which are newer than since
+ *
+ * @param since in milliseconds; 0 for the whole history window
+ * @param limit the maximum number of tuples: the oldest ones after since, otherwise the most recent ones
+ */
+static void local_range(local_channel_t *lch, long long since, size_t limit, unsigned long *from, unsigned long *to) {
+	buffer_t *buf = &lch->ch->buffer;
+	unsigned long tail = buffer_tail(buf);
+
+	*from = local_window(lch, tail);
+	*to = tail;
+
+	if (since) {
+		struct timeval tv = { .tv_sec = since / 1000, .tv_usec = (since % 1000) * 1000 };
+
+		*from = buffer_search(buf, *from, tail, tv);
+
+		if (limit && *to - *from > limit) {
+			*to = *from + limit;
+		}
+	}
+	else if (limit && *to - *from > limit) {
+		*from = *to - limit;
+	}
+}
+
+/**
+ * Append the tuples of a channel which are newer than since
+ */
+static void local_since(local_channel_t *lch, api_buffer_t *json, const local_query_t *query) {
+	unsigned long from, to;
+
+	local_range(lch, query->since, query->limit, &from, &to);
+	local_channel_json(lch, json, from, to);
+}
+
+/**
+ * Append CBOR map of a channel with the tuples which are newer than since or its aggregates
+ *
+ * Same structure as the JSON object, tuples are [int64 milliseconds, double].
+ * Encoded straight from the buffer, the snapshot is JSON only.
+ */
+static void local_channel_cbor(local_channel_t *lch, api_buffer_t *cbor, const local_query_t *query) {
+	channel_t *ch = lch->ch;
+
+	api_cbor_map(cbor, (query->aggregate) ? 7 : 6);
+	api_cbor_string(cbor, "uuid");
+	api_cbor_string(cbor, ch->uuid);
+	api_cbor_string(cbor, "middleware");
+	api_cbor_string(cbor, ch->sinks[0].middleware);
+	api_cbor_string(cbor, "last");
+	api_cbor_double(cbor, ch->last.value);
+	api_cbor_string(cbor, "interval");
+	api_cbor_int(cbor, lch->mapping->meter.interval);
+	api_cbor_string(cbor, "protocol");
+	api_cbor_string(cbor, meter_get_details(lch->mapping->meter.protocol)->name);
+
+	if (query->aggregate) {
+		double values[AGGREGATE_TYPES];
+		size_t n = 0;
+
+		aggregate_query(&ch->aggregate, local_now() - query->window * 1000LL, values);
+
+		for (int type = 0; type < AGGREGATE_TYPES; type++) {
+			n += (query->aggregate >> type) & 1;
+		}
+
+		api_cbor_string(cbor, "window");
+		api_cbor_int(cbor, query->window);
+		api_cbor_string(cbor, "aggregate");
+		api_cbor_map(cbor, n);
+
+		for (int type = 0; type < AGGREGATE_TYPES; type++) {
+			if (query->aggregate & (1 << type)) {
+				api_cbor_string(cbor, aggregate_name(type));
+
+				if (type == AGGREGATE_COUNT) {
+					api_cbor_int(cbor, values[type]);
+				}
+				else {
+					api_cbor_double(cbor, values[type]);
+				}
+			}
+		}
+	}
+	else {
+		unsigned long from, to;
+
+		local_range(lch, query->since, query->limit, &from, &to);
+
+		api_cbor_string(cbor, "tuples");
+		api_cbor_tuples(cbor, &ch->buffer, from, to, (size_t) -1);
+	}
+}
+
+/**
+ * Check if a channel has readings newer than since
+ */
+static int local_newer(local_channel_t *lch, long long since) {
+	buffer_t *buf = &lch->ch->buffer;
+	unsigned long tail = buffer_tail(buf);
+	struct timeval tv = { .tv_sec = since / 1000, .tv_usec = (since % 1000) * 1000 };
+
+	return buffer_search(buf, local_window(lch, tail), tail, tv) != tail;
+}
+
+/**
+ * Assemble the response document from the snapshots or the buffers of the requested channels
+ *
+ * @param channel the requested channel, if not all
+ * @param query NULL for the snapshots
+ * @param exception is appended to the document if not NULL
+ */
+static void local_document(local_t *local, api_buffer_t *json, local_channel_t *channel, int show_all, const local_query_t *query, const char *exception) {
+	int first = TRUE;
+
+	api_buffer_append(json, "{\"version\":", 11);
+	api_json_string(json, VERSION);
+	api_buffer_append(json, ",\"generator\":", 13);
+	api_json_string(json, PACKAGE);
+	api_buffer_append(json, ",\"data\":[", 9);
+
+	for (size_t i = 0; i < local->count; i++) {
+		local_channel_t *lch = &local->channels[i];
+
+		if (lch == channel || show_all) {
+			if (!first) {
+				api_buffer_append(json, ",", 1);
+			}
+			first = FALSE;
+
+			if (query && query->aggregate) {
+				local_channel_aggregate(lch, json, query);
+			}
+			else if (query && (query->since || query->limit)) {
+				local_since(lch, json, query);
+			}
+			else {
+				local_snapshot(lch, json);
+			}
+		}
+	}
+
+	api_buffer_append(json, "]", 1);
+
+	if (exception) {
+		api_buffer_append(json, ",\"exception\":{\"message\":", 24);
+		api_json_string(json, exception);
+		api_buffer_append(json, ",\"code\":0}", 10);
+	}
+
+	api_buffer_append(json, "}", 1);
+}
+
+/**
+ * Assemble the response document as CBOR
+ *
+ * The parameters are the same as for local_document().
+ */
+static void local_document_cbor(local_t *local, api_buffer_t *cbor, local_channel_t *channel, int show_all, const local_query_t *query, const char *exception) {
+	api_cbor_map(cbor, (exception) ? 4 : 3);
+	api_cbor_string(cbor, "version");
+	api_cbor_string(cbor, VERSION);
+	api_cbor_string(cbor, "generator");
+	api_cbor_string(cbor, PACKAGE);
+	api_cbor_string(cbor, "data");
+	api_cbor_array(cbor, (show_all) ? local->count : (channel) ? 1 : 0);
+
+	for (size_t i = 0; i < local->count; i++) {
+		local_channel_t *lch = &local->channels[i];
+
+		if (lch == channel || show_all) {
+			local_channel_cbor(lch, cbor, query);
+		}
+	}
+
+	if (exception) {
+		api_cbor_string(cbor, "exception");
+		api_cbor_map(cbor, 2);
+		api_cbor_string(cbor, "message");
+		api_cbor_string(cbor, exception);
+		api_cbor_string(cbor, "code");
+		api_cbor_int(cbor, 0);
+	}
+}
+
+/**
+ * Get the version of the requested channels without touching their buffers
+ *
+ * The versions only grow, so does their sum.
+ */
+static unsigned long local_version(local_t *local, local_channel_t *channel) {
+	unsigned long version = 0;
+
+	for (size_t i = 0; i < local->count; i++) {
+		if (channel == NULL || channel == &local->channels[i]) {
+			version += __atomic_load_n(&local->channels[i].ch->version, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	return version;
+}
+
+/**
+ * Format the ETag of a response
+ *
+ * Every representation needs its own tag.
+ *
+ * @param variant suffix for the representation, e.g. "-gz"
+ */
+static void local_etag(local_t *local, unsigned long version, const char *variant, char *etag, size_t n) {
+	snprintf(etag, n, "\"%llx-%lx%s\"", local->epoch, version, variant);
+}
+
+/**
+ * Check if one of the tags of an If-None-Match header matches
+ *
+ * Tags are compared weakly as required for If-None-Match.
+ */
+static int local_etag_match(const char *header, const char *etag) {
+	size_t len = strlen(etag);
+
+	while (header && *header) {
+		header += strspn(header, " \t,");
+
+		if (strncmp(header, "W/", 2) == 0) {
+			header += 2;
+		}
+
+		size_t n = strcspn(header, " \t,");
+
+		if ((n == 1 && *header == '*') || (n == len && strncmp(header, etag, len) == 0)) {
+			return TRUE;
+		}
+
+		header += n;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Compress a response document with gzip
+ */
+static int local_compress(api_buffer_t *in, api_buffer_t *out) {
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(z_stream));
+
+	/* 16 + MAX_WBITS: gzip header instead of zlib */
+	if (deflateInit2(&zs, options.compress_level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return ERR;
+	}
+
+	api_buffer_clear(out);
+	api_buffer_reserve(out, deflateBound(&zs, in->length));
+
+	zs.next_in = (Bytef *) in->data;
+	zs.avail_in = in->length;
+	zs.next_out = (Bytef *) out->data;
+	zs.avail_out = out->size;
+
+	int ret = deflate(&zs, Z_FINISH);
+	out->length = zs.total_out;
+	deflateEnd(&zs);
+
+	return (ret == Z_STREAM_END) ? SUCCESS : ERR;
+}
+
+static void local_gzip_init(local_gzip_t *gzip) {
+	pthread_mutex_init(&gzip->mutex, NULL);
+	api_buffer_init(&gzip->data);
+	gzip->version = 0;
+	gzip->valid = FALSE;
+}
+
+static void local_gzip_free(local_gzip_t *gzip) {
+	pthread_mutex_destroy(&gzip->mutex);
+	api_buffer_free(&gzip->data);
+}
+
+/**
+ * Check if a comet request has to be resumed
+ *
+ * Notifications for the requested channels are armed before checking for new readings.
+ */
+static int local_request_due(local_t *local, local_request_t *req, long long now, int shutdown) {
+	int due = (shutdown || now >= req->deadline);
+
+	for (size_t i = 0, j = 0; i < local->count; i++) {
+		local_channel_t *lch = &local->channels[i];
+
+		if (req->channel && req->channel != lch) {
+			continue;
+		}
+
+		__atomic_store_n(&lch->ch->local->waiting, 1, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&lch->ch->buffer.tail, __ATOMIC_SEQ_CST) != req->tails[j++]) {
+			due = TRUE;
+		}
+	}
+
+	return due;
+}
+
+/**
+ * Create the state of a comet request or event stream
+ *
+ * The tails of the requested channels are recorded.
+ *
+ * @return NULL if out of memory
+ */
+static local_request_t * local_request_new(local_t *local, struct MHD_Connection *connection, local_channel_t *channel) {
+	local_request_t *req = malloc(sizeof(local_request_t));
+	unsigned long *tails = malloc(((channel) ? 1 : local->count) * sizeof(unsigned long));
+
+	if (req == NULL || tails == NULL) {
+		print(log_error, "Cannot allocate memory for request", "http");
+		free(req);
+		free(tails);
+		return NULL;
+	}
+
+	req->local = local;
+	req->connection = connection;
+	req->channel = channel;
+	req->tails = tails;
+	req->deadline = local_now() + options.comet_timeout * 1000LL;
+	req->stream = FALSE;
+	req->offset = 0;
+	api_buffer_init(&req->events);
+
+	for (size_t i = 0, j = 0; i < local->count; i++) {
+		if (channel == NULL || channel == &local->channels[i]) {
+			req->tails[j++] = buffer_tail(&local->channels[i].ch->buffer);
+		}
+	}
+
+	return req;
+}
+
+/**
+ * Suspend a request until the comet thread resumes it
+ *
+ * Must be called from a libmicrohttpd callback of the connection.
+ *
+ * @return FALSE if we are shutting down
+ */
+static int local_request_suspend(local_t *local, local_request_t *req) {
+	pthread_mutex_lock(&local->mutex);
+	int suspend = !local->shutdown;
+	if (suspend) {
+		req->next = local->suspended;
+		local->suspended = req;
+		MHD_suspend_connection(req->connection);
+	}
+	pthread_mutex_unlock(&local->mutex);
+
+	if (suspend && write(local->notify[1], "", 1) < 0) {
+		/* pipe is full, the thread will wake up anyway */
+	}
+
+	return suspend;
+}
+
+/**
+ * Resume suspended requests on new readings or timeout
+ */
+static void * local_comet_thread(void *arg) {
+	local_t *local = (local_t *) arg;
+	char drain[64];
+
+	while (TRUE) {
+		long long now = local_now();
+		int timeout = -1;
+
+		pthread_mutex_lock(&local->mutex);
+		int shutdown = local->shutdown; /* no requests get suspended afterwards */
+
+		for (local_request_t **req = &local->suspended; *req; ) {
+			if (local_request_due(local, *req, now, shutdown)) {
+				local_request_t *resumed = *req;
+
+				*req = resumed->next; /* unlink */
+				MHD_resume_connection(resumed->connection);
+			}
+			else {
+				/* streams without keepalives only wait for new readings */
+				if ((*req)->deadline != LLONG_MAX && (timeout < 0 || (*req)->deadline - now < timeout)) {
+					timeout = (*req)->deadline - now;
+				}
+
+				req = &(*req)->next;
+			}
+		}
+		pthread_mutex_unlock(&local->mutex);
+
+		if (shutdown) {
+			break;
+		}
+
+		struct pollfd pfd = { .fd = local->notify[0], .events = POLLIN };
+		if (poll(&pfd, 1, timeout) > 0) {
+			while (read(local->notify[0], drain, sizeof(drain)) > 0);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Free the state of comet requests and event streams
+ */
+static void local_request_completed(void *cls, struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe) {
+	local_request_t *req = (local_request_t *) *con_cls;
+
+	if (req) {
+		api_buffer_free(&req->events);
+		free(req->tails);
+		free(req);
+		*con_cls = NULL;
+	}
+}
+
+/**
+ * Get the time of the next keepalive of an event stream
+ *
+ * Streams don't time out, the comet timeout is only used as keepalive interval.
+ * Without a timeout, no keepalives are sent.
+ */
+static long long local_keepalive(long long now) {
+	return (options.comet_timeout > 0) ? now + options.comet_timeout * 1000LL : LLONG_MAX;
+}
+
+/**
+ * Encode new tuples of the subscribed channels as server-sent events
+ *
+ * Event: data: {"uuid":"...","tuples":[[ts,value],...]}
+ *        id: <timestamp of the last tuple>
+ *
+ * A comment is sent as keepalive if there were no new tuples for a while.
+ */
+static void local_stream_events(local_t *local, local_request_t *req) {
+	api_buffer_t *events = &req->events;
+	long long now = local_now();
+
+	for (size_t i = 0, j = 0; i < local->count; i++) {
+		local_channel_t *lch = &local->channels[i];
+		buffer_t *buf = &lch->ch->buffer;
+
+		if (req->channel && req->channel != lch) {
+			continue;
+		}
+
+		unsigned long tail = buffer_tail(buf);
+		unsigned long *seq = &req->tails[j++];
+
+		if (tail == *seq) {
+			continue;
+		}
+
+		size_t length = events->length;
+
+		api_buffer_append(events, "data: {\"uuid\":", 14);
+		api_json_string(events, lch->ch->uuid);
+		api_buffer_append(events, ",\"tuples\":", 10);
+		*seq = api_json_tuples(events, buf, *seq, tail, (size_t) -1);
+		api_buffer_append(events, "}\nid: ", 6);
+
+		/* the id allows clients to resume with the Last-Event-ID header */
+		unsigned long last = *seq - 1;
+		reading_t rd;
+
+		if (buffer_read(buf, &last, *seq, &rd, 1) == 0) { /* already dropped */
+			events->length = length;
+			events->data[length] = '\0';
+			continue;
+		}
+
+		api_json_int(events, (long long) rd.time.tv_sec * 1000 + rd.time.tv_usec / 1000);
+		api_buffer_append(events, "\n\n", 2);
+	}
+
+	if (events->length == 0 && now >= req->deadline) {
+		api_buffer_append(events, ":\n\n", 3);
+	}
+
+	if (events->length > 0) {
+		req->deadline = local_keepalive(now);
+	}
+}
+
+/**
+ * Pass events to libmicrohttpd, suspend the stream if there are none
+ */
+static ssize_t local_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+	local_request_t *req = (local_request_t *) cls;
+	local_t *local = req->local;
+
+	if (req->offset == req->events.length) {
+		api_buffer_clear(&req->events);
+		req->offset = 0;
+
+		local_stream_events(local, req);
+	}
+
+	if (req->events.length == 0) {
+		/* the comet thread resumes the stream and we get called again */
+		return (local_request_suspend(local, req)) ? 0 : MHD_CONTENT_READER_END_OF_STREAM;
+	}
+
+	size_t n = req->events.length - req->offset;
+	if (n > max) {
+		n = max;
+	}
+
+	memcpy(buf, req->events.data + req->offset, n);
+	req->offset += n;
+
+	return n;
+}
+
+/**
+ * Subscribe to server-sent events
+ *
+ * @param since in milliseconds; send buffered tuples newer than this first, 0 for only new tuples
+ */
+static int local_stream(local_t *local, struct MHD_Connection *connection, local_channel_t *channel, long long since, void **con_cls) {
+	local_request_t *req = local_request_new(local, connection, channel);
+	struct MHD_Response *response;
+	int status;
+
+	if (req == NULL) {
+		response = MHD_create_response_from_data(0, NULL, FALSE, FALSE);
+		status = MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE, response);
+		MHD_destroy_response(response);
+
+		return status;
+	}
+
+	req->stream = TRUE;
+	req->deadline = local_keepalive(local_now());
+	*con_cls = req; /* freed by local_request_completed() */
+
+	if (since) {
+		struct timeval tv = { .tv_sec = since / 1000, .tv_usec = (since % 1000) * 1000 };
+
+		for (size_t i = 0, j = 0; i < local->count; i++) {
+			local_channel_t *lch = &local->channels[i];
+
+			if (channel == NULL || channel == lch) {
+				req->tails[j] = buffer_search(&lch->ch->buffer, local_window(lch, req->tails[j]), req->tails[j], tv);
+				j++;
+			}
+		}
+	}
+
+	response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4096, &local_stream_read, req, NULL);
+
+	MHD_add_response_header(response, "Content-type", "text/event-stream");
+	MHD_add_response_header(response, "Cache-Control", "no-cache");
+
+	status = MHD_queue_response(connection, MHD_HTTP_OK, response);
+
+	MHD_destroy_response(response);
+
+	return status;
+}
+
+int local_init(local_t *local, list_t *mappings, channel_index_t *index) {
+	local->index = index;
+	local->count = index->count;
+	local->suspended = NULL;
+	local->shutdown = FALSE;
+	local->epoch = local_now();
+	local_gzip_init(&local->gzip);
+
+	local->channels = malloc(local->count * sizeof(local_channel_t));
+	if (local->channels == NULL || pipe(local->notify) != 0) {
+		print(log_error, "Cannot initialize local interface", "http");
+		return ERR;
+	}
+
+	/* neither the reading threads nor the comet thread may block on the pipe */
+	for (int j = 0; j < 2; j++) {
+		fcntl(local->notify[j], F_SETFL, O_NONBLOCK);
+		fcntl(local->notify[j], F_SETFD, FD_CLOEXEC);
+	}
+
+	foreach(*mappings, mapping, map_t) {
+		foreach(mapping->channels, ch, channel_t) {
+			local_channel_t *lch = &local->channels[ch->index];
+
+			lch->ch = ch;
+			lch->mapping = mapping;
+			lch->tail = 0;
+			lch->valid = FALSE;
+			api_buffer_init(&lch->json);
+			pthread_mutex_init(&lch->mutex, NULL);
+			local_gzip_init(&lch->gzip);
+
+			ch->local->fd = local->notify[1];
+		}
+	}
+
+	pthread_mutex_init(&local->mutex, NULL);
+	pthread_create(&local->thread, NULL, &local_comet_thread, (void *) local);
+
+	/* comet requests are suspended instead of blocking a thread of the pool */
+	local->httpd = MHD_start_daemon(
+		MHD_USE_AUTO_INTERNAL_THREAD | MHD_USE_SUSPEND_RESUME,
+		options.port,
+		NULL, NULL,
+		&handle_request, (void *) local,
+		MHD_OPTION_THREAD_POOL_SIZE, (unsigned int) options.local_threads,
+		MHD_OPTION_NOTIFY_COMPLETED, &local_request_completed, NULL,
+		MHD_OPTION_END
+	);
+
+	if (local->httpd == NULL) {
+		print(log_error, "Cannot start HTTPd on port %i", "http", options.port);
+		return ERR;
+	}
+
+	return SUCCESS;
+}
+
+void local_free(local_t *local) {
+	/* the HTTPd cannot be stopped with suspended connections */
+	pthread_mutex_lock(&local->mutex);
+	local->shutdown = TRUE;
+	pthread_mutex_unlock(&local->mutex);
+
+	if (write(local->notify[1], "", 1) < 0) {
+		/* pipe is full, the thread will wake up anyway */
+	}
+
+	pthread_join(local->thread, NULL);
+
+	if (local->httpd) {
+		MHD_stop_daemon(local->httpd);
+	}
+
+	for (size_t i = 0; i < local->count; i++) {
+		local->channels[i].ch->local->fd = -1;
+		api_buffer_free(&local->channels[i].json);
+		pthread_mutex_destroy(&local->channels[i].mutex);
+		local_gzip_free(&local->channels[i].gzip);
+	}
+
+	local_gzip_free(&local->gzip);
+
+	pthread_mutex_destroy(&local->mutex);
+	close(local->notify[0]);
+	close(local->notify[1]);
+	free(local->channels);
+}
+
 int handle_request(void *cls, struct MHD_Connection *connection, const char *url, const char *method,
 			const char *version, const char *upload_data, size_t *upload_data_size, void **con_cls) {
 
 	int status;
 	int response_code = MHD_HTTP_NOT_FOUND;
 
-	list_t *mappings = (list_t *) cls;
+	local_t *local = (local_t *) cls;
+	local_request_t *req = (local_request_t *) *con_cls;
 
 	struct MHD_Response *response;
 	const char *mode = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "mode");
 
-	print(log_info+1, "Local request received: method=%s url=%s mode=%s", "http", method, url, mode);
+	if (req == NULL) { /* not resumed */
+		print(log_info+1, "Local request received: method=%s url=%s mode=%s", "http", method, url, mode);
+	}
 
 	if (strcmp(method, "GET") == 0) {
-		struct timespec ts;
-		struct timeval tp;
-
-		struct json_object *json_obj = json_object_new_object();
-		struct json_object *json_data = json_object_new_array();
-		struct json_object *json_exception = NULL;
+		/* the response is assembled from the snapshots in a buffer which is handed over to libmicrohttpd */
+		api_buffer_t body;
 
 		const char *uuid = url + 1; /* strip leading slash */
-		const char *json_str;
+		const char *exception = NULL;
+		local_channel_t *channel = NULL;
 		int show_all = 0;
+		char etag[64];
+
+		/* incremental queries */
+		const char *since_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "since");
+		const char *limit_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "limit");
+		local_query_t query = { .since = 0, .limit = 0, .aggregate = 0, .window = options.buffer_length };
+		long long limit;
+		char *end;
+
+		if (since_str) {
+			query.since = strtoll(since_str, &end, 10);
+			if (*end != '\0' || query.since < 0) {
+				exception = "invalid since";
+			}
+		}
 
-		if (strcmp(url, "/") == 0) {
+		if (limit_str) {
+			limit = strtoll(limit_str, &end, 10);
+			if (*end != '\0' || limit < 0) {
+				exception = "invalid limit";
+			}
+			query.limit = limit;
+		}
+
+		/* aggregates instead of tuples */
+		const char *aggregate_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "aggregate");
+		const char *window_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "window");
+
+		if (aggregate_str && (query.aggregate = aggregate_parse(aggregate_str)) == 0) {
+			exception = "invalid aggregate";
+		}
+
+		if (window_str) {
+			query.window = strtol(window_str, &end, 10);
+			if (*end != '\0' || query.window <= 0) {
+				exception = "invalid window";
+			}
+		}
+
+		/* representation: query parameter takes precedence over Accept header */
+		const char *format_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "format");
+		const char *accept = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept");
+		int format = LOCAL_JSON;
+
+		if (format_str) {
+			if (strcmp(format_str, "cbor") == 0) {
+				format = LOCAL_CBOR;
+			}
+			else if (strcmp(format_str, "json") != 0) {
+				exception = "invalid format";
+			}
+		}
+		else if (accept && strstr(accept, "application/cbor")) {
+			format = LOCAL_CBOR;
+		}
+
+		if (exception) {
+			response_code = MHD_HTTP_BAD_REQUEST;
+		}
+		else if (strcmp(url, "/") == 0) {
 			if (options.channel_index) {
 				show_all = TRUE;
 			}
 			else {
-				json_exception = json_object_new_object();
+				exception = "channel index is disabled";
+			}
+		}
+		else {
+			channel_t *ch = channel_index_lookup(local->index, uuid);
 
-				json_object_object_add(json_exception, "message", json_object_new_string("channel index is disabled"));
-				json_object_object_add(json_exception, "code", json_object_new_int(0));
+			if (ch) {
+				channel = &local->channels[ch->index];
 			}
 		}
 
-		foreach(*mappings, mapping, map_t) {
-			foreach(mapping->channels, ch, channel_t) {
-				if (strcmp(ch->uuid, uuid) == 0 || show_all) {
-					response_code = MHD_HTTP_OK;
+		/* push new tuples as server-sent events */
+		if (mode && strcmp(mode, "sse") == 0 && (show_all || channel)) {
+			const char *last_id = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Last-Event-ID");
 
-					/* blocking until new data arrives (comet-like blocking of HTTP response) */
-					if (mode && strcmp(mode, "comet") == 0) {
-						/* convert from timeval to timespec */
-						gettimeofday(&tp, NULL);
-						ts.tv_sec  = tp.tv_sec + options.comet_timeout;
-						ts.tv_nsec = tp.tv_usec * 1000;
+			if (last_id) { /* reconnecting client */
+				query.since = strtoll(last_id, NULL, 10);
+			}
 
-						pthread_mutex_lock(&ch->buffer.mutex);
-						pthread_cond_timedwait(&ch->condition, &ch->buffer.mutex, &ts);
-						pthread_mutex_unlock(&ch->buffer.mutex);
-					}
+			return local_stream(local, connection, channel, query.since, con_cls);
+		}
 
-					struct json_object *json_ch = json_object_new_object();
+		/* blocking until new data arrives (comet-like blocking of HTTP response) */
+		int comet = (mode && strcmp(mode, "comet") == 0 && req == NULL && (show_all || channel));
 
-					json_object_object_add(json_ch, "uuid", json_object_new_string(ch->uuid));
-					json_object_object_add(json_ch, "middleware", json_object_new_string(ch->middleware));
-					json_object_object_add(json_ch, "last", json_object_new_double(ch->last.value));
-					json_object_object_add(json_ch, "interval", json_object_new_int(mapping->meter.interval));
-					json_object_object_add(json_ch, "protocol", json_object_new_string(meter_get_details(mapping->meter.protocol)->name));
+		/* no need to wait if there are already newer readings */
+		for (size_t i = 0; i < local->count && comet && query.since; i++) {
+			if ((show_all || channel == &local->channels[i]) && local_newer(&local->channels[i], query.since)) {
+				comet = FALSE;
+			}
+		}
 
-					struct json_object *json_tuples = api_json_tuples(&ch->buffer, ch->buffer.head, ch->buffer.tail);
-					json_object_object_add(json_ch, "tuples", json_tuples);
+		if (comet) {
+			req = local_request_new(local, connection, channel);
+			*con_cls = req; /* freed by local_request_completed() */
 
-					json_object_array_add(json_data, json_ch);
+			/* the comet thread resumes the connection and we get called again,
+			   without memory we answer immediately */
+			if (req && local_request_suspend(local, req)) {
+				return MHD_YES;
+			}
+		}
+
+		response = NULL;
+		etag[0] = '\0';
+
+		if (show_all || channel) {
+			response_code = MHD_HTTP_OK;
+		}
+
+		/* aggregates slide with time, so they cannot be validated by the versions */
+		if (response_code == MHD_HTTP_OK && query.aggregate == 0) {
+			/* the version is taken first, so the document is at least as recent as its ETag */
+			unsigned long version = local_version(local, channel);
+			const char *encoding = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept-Encoding");
+			const char *match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
+
+			/* only complete JSON snapshots are worth caching */
+			int gzip = (format == LOCAL_JSON && encoding && strstr(encoding, "gzip") && query.since == 0 && query.limit == 0);
+
+			local_etag(local, version, (gzip) ? "-gz" : (format == LOCAL_CBOR) ? "-cbor" : "", etag, sizeof(etag));
+
+			if (local_etag_match(match, etag)) {
+				response = MHD_create_response_from_data(0, NULL, FALSE, FALSE);
+				response_code = MHD_HTTP_NOT_MODIFIED;
+			}
+			else if (gzip) {
+				local_gzip_t *cache = (channel) ? &channel->gzip : &local->gzip;
+
+				pthread_mutex_lock(&cache->mutex);
+
+				if (!cache->valid || cache->version != version) {
+					api_buffer_init(&body);
+					local_document(local, &body, channel, show_all, NULL, NULL);
+
+					cache->valid = (local_compress(&body, &cache->data) == SUCCESS);
+					cache->version = version;
+
+					api_buffer_free(&body);
 				}
+
+				if (cache->valid) {
+					response = MHD_create_response_from_data(cache->data.length, (void *) cache->data.data, FALSE, TRUE);
+					MHD_add_response_header(response, "Content-Encoding", "gzip");
+				}
+				else {
+					print(log_error, "Cannot compress response", "http");
+					local_etag(local, version, "", etag, sizeof(etag));
+				}
+
+				pthread_mutex_unlock(&cache->mutex);
 			}
 		}
 
-		json_object_object_add(json_obj, "version", json_object_new_string(VERSION));
-		json_object_object_add(json_obj, "generator", json_object_new_string(PACKAGE));
-		json_object_object_add(json_obj, "data", json_data);
+		if (response == NULL) {
+			api_buffer_init(&body);
 
-		if (json_exception) {
-			json_object_object_add(json_obj, "exception", json_exception);
+			if (format == LOCAL_CBOR) {
+				local_document_cbor(local, &body, channel, show_all, &query, exception);
+			}
+			else {
+				local_document(local, &body, channel, show_all, &query, exception);
+			}
+
+			/* libmicrohttpd takes ownership of the buffer */
+			response = MHD_create_response_from_data(body.length, (void *) body.data, TRUE, FALSE);
 		}
 
-		json_str = json_object_to_json_string(json_obj);
-		response = MHD_create_response_from_data(strlen(json_str), (void *) json_str, FALSE, TRUE);
-		json_object_put(json_obj);
+		if (etag[0]) {
+			MHD_add_response_header(response, "ETag", etag);
+		}
+
+		if (response_code == MHD_HTTP_OK || response_code == MHD_HTTP_NOT_MODIFIED) {
+			MHD_add_response_header(response, "Vary", "Accept, Accept-Encoding");
+		}
 
-		MHD_add_response_header(response, "Content-type", "application/json");
+		MHD_add_response_header(response, "Content-type", (format == LOCAL_CBOR) ? "application/cbor" : "application/json");
 	}
 	else {
 		char *response_str = strdup("not implemented\n");
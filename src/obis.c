@@ -92,6 +92,8 @@ const obis_alias_t * obis_get_aliases() {
 }
 
 obis_id_t * obis_init(obis_id_t *id, unsigned char *raw) {
+	id->packed = 0;
+
 	if (raw == NULL) {
 		// TODO why not initialize with DC fields to accept all readings?
 		memset(id->raw, 0, 6); /* initialize with zeros */
@@ -113,6 +115,7 @@ int obis_parse(const char *str, obis_id_t *id) {
 
 	num = byte = 0;
 	field = -1;
+	id->packed = 0;
 	memset(&id->raw, 0xff, 6); /* initialize as wildcard */
 
 	/* format: "A-B:C.D.E[*&]F" */
@@ -154,9 +157,9 @@ int obis_parse(const char *str, obis_id_t *id) {
 }
 
 int obis_lookup_alias(const char *alias, obis_id_t *id) {
-	for (const obis_alias_t *it = aliases; it != NULL; it++) {
+	for (const obis_alias_t *it = aliases; it->name != NULL; it++) {
 		if (strcmp(it->name, alias) == 0) {
-			*id = it->id;
+			id->packed = it->id.packed & OBIS_PACKED_MASK;
 			return SUCCESS;
 		}
 	}
@@ -174,7 +177,23 @@ int obis_unparse(obis_id_t id, char *buffer, size_t n) {
 	);
 }
 
+uint64_t obis_mask(obis_id_t id) {
+	const uint64_t low = 0x7f7f7f7f7f7f7f7fULL;
+	uint64_t inverted = ~id.packed; /* wildcards become zero bytes */
+
+	/* set the most significant bit of every non-zero byte */
+	uint64_t nonzero = (((inverted & low) + low) | inverted) & ~low;
+
+	/* spread it over the whole byte */
+	return ((nonzero >> 7) * 0xff) & OBIS_PACKED_MASK;
+}
+
 int obis_compare(obis_id_t a, obis_id_t b) {
+	if (((a.packed ^ b.packed) & obis_mask(a) & obis_mask(b)) == 0) {
+		return 0; /* equal */
+	}
+
+	/* order by the first group which differs */
 	for (int i = 0; i < 6; i++) {
 		if (a.raw[i] == b.raw[i] || a.raw[i] == 0xff || b.raw[i] == 0xff ) {
 			continue; /* skip on wildcard or equal */
@@ -191,14 +210,7 @@ int obis_compare(obis_id_t a, obis_id_t b) {
 }
 
 int obis_is_null(obis_id_t id) {
-	return !(
-		id.raw[0] ||
-		id.raw[1] ||
-		id.raw[2] ||
-		id.raw[3] ||
-		id.raw[4] ||
-		id.raw[5]
-	);
+	return (id.packed & OBIS_PACKED_MASK) == 0;
 }
 
 int obis_is_manufacturer_specific(obis_id_t id) {
@@ -0,0 +1,473 @@
+/**
+ * Persistent write-ahead spool for unsent readings
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "spool.h"
+#include "common.h"
+
+static uint32_t crc_table[256];
+
+/**
+ * CRC-32 (IEEE 802.3) as used by zlib/gzip
+ */
+static uint32_t spool_crc32(const void *data, size_t len) {
+	const unsigned char *p = data;
+	uint32_t crc = 0xffffffff;
+
+	while (len--) {
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc ^ 0xffffffff;
+}
+
+static void spool_crc32_init() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+}
+
+static int spool_record_valid(const spool_record_t *rec) {
+	return rec->crc == spool_crc32((char *) rec + sizeof(rec->crc), sizeof(spool_record_t) - sizeof(rec->crc));
+}
+
+static int spool_segment_open(spool_t *spool, unsigned long first, int flags) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016lx.seg", first);
+
+	return openat(spool->dirfd, name, flags | O_CLOEXEC, 0644);
+}
+
+static int spool_compare_seq(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *) a;
+	unsigned long y = *(const unsigned long *) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Write pending records to the current segment
+ *
+ * Has to be called with locked mutex!
+ */
+static int spool_flush(spool_t *spool) {
+	size_t len = spool->pending * sizeof(spool_record_t);
+
+	spool->pending = 0;
+
+	if (len > 0 && write(spool->fd, spool->buffer, len) != (ssize_t) len) {
+		print(log_error, "Cannot write to spool %s, dropping %zu readings: %s", NULL,
+			spool->path, len / sizeof(spool_record_t), strerror(errno));
+
+		/* records are located by their position in the segment,
+		   so spool_append() has to continue with a new one */
+		close(spool->fd);
+		spool->fd = -1;
+
+		return ERR;
+	}
+
+	return SUCCESS;
+}
+
+/**
+ * Remove oldest segment
+ *
+ * Has to be called with locked mutex!
+ */
+static void spool_drop(spool_t *spool) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016lx.seg", spool->segments[0]);
+
+	unlinkat(spool->dirfd, name, 0);
+
+	memmove(spool->segments, spool->segments + 1, --spool->count * sizeof(unsigned long));
+}
+
+/**
+ * Start a new segment and enforce the size limit
+ *
+ * Has to be called with locked mutex!
+ */
+static int spool_roll(spool_t *spool) {
+	if (spool->fd >= 0 && spool_flush(spool) == SUCCESS) {
+		fsync(spool->fd);
+		close(spool->fd);
+		spool->fd = -1;
+	}
+
+	spool->failed = time(NULL);
+
+	unsigned long *segments = realloc(spool->segments, (spool->count + 1) * sizeof(unsigned long));
+	if (segments == NULL) {
+		print(log_error, "Cannot allocate memory for spool %s", NULL, spool->path);
+		return ERR;
+	}
+
+	spool->segments = segments;
+
+	spool->fd = spool_segment_open(spool, spool->next, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND);
+	if (spool->fd < 0) {
+		print(log_error, "Cannot create spool segment in %s: %s", NULL, spool->path, strerror(errno));
+		return ERR;
+	}
+
+	fsync(spool->dirfd); /* persist directory entry */
+
+	spool->failed = 0;
+	spool->segments[spool->count++] = spool->next;
+	spool->records = 0;
+
+	/* enforce size limit by dropping the oldest segments */
+	while (spool->count > 1 && (spool->count - 1) * SPOOL_SEGMENT_RECORDS * sizeof(spool_record_t) > spool->max) {
+		if ((long) (spool->segments[1] - spool->acked) > 0) {
+			print(log_warning, "Spool %s exceeds size limit, dropping %lu unsent readings", NULL,
+				spool->path, spool->segments[1] - spool->acked);
+			spool->acked = spool->segments[1];
+		}
+
+		spool_drop(spool);
+	}
+
+	return SUCCESS;
+}
+
+int spool_open(spool_t *spool, const char *path, size_t max, int sync) {
+	static int crc_initialized;
+
+	if (!crc_initialized) {
+		spool_crc32_init();
+		crc_initialized = TRUE;
+	}
+
+	spool->path = strdup(path);
+	spool->fd = -1;
+	spool->dirfd = -1;
+	spool->ackfd = -1;
+	spool->segments = NULL;
+	spool->count = 0;
+	spool->records = 0;
+	spool->pending = 0;
+	spool->next = 0;
+	spool->acked = 0;
+	spool->failed = 0;
+	spool->max = max;
+	spool->sync = sync;
+	spool->synced = time(NULL);
+	pthread_mutex_init(&spool->mutex, NULL);
+
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		print(log_error, "Cannot create spool directory %s: %s", NULL, path, strerror(errno));
+		return ERR;
+	}
+
+	spool->dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = (spool->dirfd < 0) ? NULL : fdopendir(dup(spool->dirfd));
+	if (dir == NULL) {
+		print(log_error, "Cannot open spool directory %s: %s", NULL, path, strerror(errno));
+		return ERR;
+	}
+
+	/* find existing segments */
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		unsigned long first;
+		char suffix[5];
+
+		if (sscanf(entry->d_name, "%16lx.%4s", &first, suffix) == 2 && strcmp(suffix, "seg") == 0) {
+			unsigned long *segments = realloc(spool->segments, (spool->count + 1) * sizeof(unsigned long));
+			if (segments == NULL) {
+				closedir(dir);
+				return ERR;
+			}
+
+			spool->segments = segments;
+			spool->segments[spool->count++] = first;
+		}
+	}
+	closedir(dir);
+
+	qsort(spool->segments, spool->count, sizeof(unsigned long), &spool_compare_seq);
+
+	/* restore acknowledged position */
+	spool->ackfd = openat(spool->dirfd, "acked", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (spool->ackfd < 0) {
+		print(log_error, "Cannot open spool %s: %s", NULL, path, strerror(errno));
+		return ERR;
+	}
+
+	uint64_t acked;
+	if (pread(spool->ackfd, &acked, sizeof(acked), 0) == sizeof(acked)) {
+		spool->acked = acked;
+	}
+
+	/* find last valid record and truncate partially written ones */
+	if (spool->count > 0) {
+		unsigned long first = spool->segments[spool->count - 1];
+		spool_record_t rec;
+		struct stat st;
+
+		spool->fd = spool_segment_open(spool, first, O_RDWR | O_APPEND);
+		if (spool->fd < 0 || fstat(spool->fd, &st) != 0) {
+			print(log_error, "Cannot open spool segment in %s: %s", NULL, path, strerror(errno));
+			return ERR;
+		}
+
+		spool->records = st.st_size / sizeof(spool_record_t);
+		while (spool->records > 0) {
+			if (pread(spool->fd, &rec, sizeof(rec), (spool->records - 1) * sizeof(rec)) == sizeof(rec) &&
+				spool_record_valid(&rec) && rec.seq == first + spool->records - 1) {
+				break;
+			}
+
+			spool->records--;
+		}
+
+		if (ftruncate(spool->fd, spool->records * sizeof(spool_record_t)) != 0) {
+			print(log_error, "Cannot truncate spool segment in %s: %s", NULL, path, strerror(errno));
+			return ERR;
+		}
+
+		spool->next = first + spool->records;
+	}
+	else {
+		spool->next = spool->acked;
+	}
+
+	if ((long) (spool->acked - spool->next) > 0) {
+		spool->acked = spool->next; /* inconsistent acknowledgement */
+	}
+
+	if (spool->acked != spool->next) {
+		print(log_info, "Replaying %lu unsent readings from spool %s", NULL, spool->next - spool->acked, path);
+	}
+
+	return spool_ack(spool, spool->acked);
+}
+
+void spool_close(spool_t *spool) {
+	pthread_mutex_lock(&spool->mutex);
+	if (spool->fd >= 0 && spool_flush(spool) == SUCCESS) {
+		fsync(spool->fd);
+		close(spool->fd);
+	}
+
+	if (spool->ackfd >= 0) {
+		fsync(spool->ackfd);
+		close(spool->ackfd);
+	}
+
+	if (spool->dirfd >= 0) {
+		close(spool->dirfd);
+	}
+	pthread_mutex_unlock(&spool->mutex);
+
+	pthread_mutex_destroy(&spool->mutex);
+
+	free(spool->segments);
+	free(spool->path);
+}
+
+int spool_append(spool_t *spool, unsigned long seq, const reading_t *rd) {
+	int ret = SUCCESS;
+
+	pthread_mutex_lock(&spool->mutex);
+	if ((long) (seq - spool->next) < 0) {
+		print(log_error, "Spool %s is out of sequence (%lu < %lu)", NULL, spool->path, seq, spool->next);
+		pthread_mutex_unlock(&spool->mutex);
+		return ERR;
+	}
+
+	if (seq != spool->next) { /* readings have been missed: continue after the gap in a new segment */
+		print(log_warning, "Spool %s is missing %lu readings", NULL, spool->path, seq - spool->next);
+
+		if (spool->fd >= 0 && spool_flush(spool) == SUCCESS) {
+			close(spool->fd);
+			spool->fd = -1;
+		}
+
+		spool->next = seq;
+	}
+
+	if (spool->fd < 0 && spool->failed && time(NULL) - spool->failed < SPOOL_RETRY) {
+		ret = ERR; /* don't hammer a full disk */
+	}
+	else if (spool->fd < 0 || spool->records == SPOOL_SEGMENT_RECORDS) {
+		ret = spool_roll(spool);
+	}
+
+	if (ret == SUCCESS) {
+		spool_record_t *rec = &spool->buffer[spool->pending++];
+
+		rec->reserved = 0;
+		rec->seq = seq;
+		rec->time = (int64_t) rd->time.tv_sec * 1000000 + rd->time.tv_usec;
+		rec->value = rd->value;
+		rec->crc = spool_crc32((char *) rec + sizeof(rec->crc), sizeof(spool_record_t) - sizeof(rec->crc));
+
+		spool->records++;
+		spool->next++;
+
+		if (spool->pending == SPOOL_PENDING) {
+			ret = spool_flush(spool);
+		}
+	}
+	else {
+		spool->next++; /* leave a gap which is skipped by spool_read() */
+	}
+	pthread_mutex_unlock(&spool->mutex);
+
+	return ret;
+}
+
+int spool_sync(spool_t *spool) {
+	int ret = SUCCESS;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&spool->mutex);
+	if (spool->fd >= 0) {
+		ret = spool_flush(spool);
+
+		/* batch expensive fsync() calls */
+		if (ret == SUCCESS && now - spool->synced >= spool->sync) {
+			fdatasync(spool->fd);
+			fdatasync(spool->ackfd);
+			spool->synced = now;
+		}
+	}
+	pthread_mutex_unlock(&spool->mutex);
+
+	return ret;
+}
+
+size_t spool_read(spool_t *spool, unsigned long *from, unsigned long to, reading_t *rds, size_t n) {
+	unsigned long seq = *from;
+	size_t count = 0;
+
+	pthread_mutex_lock(&spool->mutex);
+	spool_flush(spool); /* make pending records visible */
+
+	if ((long) (spool->acked - seq) > 0) {
+		seq = spool->acked; /* has been dropped */
+	}
+
+	if ((long) (to - spool->next) > 0) {
+		to = spool->next;
+	}
+
+	/* start with the segment containing seq */
+	size_t i = spool->count;
+	while (i > 0 && (long) (spool->segments[i - 1] - seq) > 0) {
+		i--;
+	}
+
+	for (i = (i > 0) ? i - 1 : 0; i < spool->count && count < n && (long) (to - seq) > 0; i++) {
+		unsigned long first = spool->segments[i];
+		unsigned long end = (i + 1 < spool->count) ? spool->segments[i + 1] : spool->next;
+
+		if ((long) (first - seq) > 0) {
+			seq = first; /* gap between segments */
+		}
+
+		int fd = spool_segment_open(spool, first, O_RDONLY);
+		if (fd < 0) {
+			print(log_error, "Cannot open spool segment in %s: %s", NULL, spool->path, strerror(errno));
+			seq = end; /* skip segment */
+			continue;
+		}
+
+		spool_record_t recs[SPOOL_PENDING];
+		while (count < n && (long) (to - seq) > 0 && (long) (end - seq) > 0) {
+			size_t want = end - seq;
+			if (want > SPOOL_PENDING) want = SPOOL_PENDING;
+			if (want > to - seq) want = to - seq;
+			if (want > n - count) want = n - count;
+
+			ssize_t len = pread(fd, recs, want * sizeof(spool_record_t), (seq - first) * sizeof(spool_record_t));
+			if (len < (ssize_t) sizeof(spool_record_t)) {
+				seq = end; /* truncated segment */
+				break;
+			}
+
+			for (size_t j = 0; j < len / sizeof(spool_record_t); j++, seq++) {
+				if (!spool_record_valid(&recs[j]) || recs[j].seq != seq) {
+					print(log_warning, "Skipping corrupted record %lu in spool %s", NULL, seq, spool->path);
+					continue;
+				}
+
+				memset(&rds[count], 0, sizeof(reading_t));
+				rds[count].time.tv_sec = recs[j].time / 1000000;
+				rds[count].time.tv_usec = recs[j].time % 1000000;
+				rds[count].value = recs[j].value;
+				count++;
+			}
+		}
+
+		close(fd);
+	}
+	pthread_mutex_unlock(&spool->mutex);
+
+	*from = seq;
+
+	return count;
+}
+
+int spool_ack(spool_t *spool, unsigned long seq) {
+	int ret = SUCCESS;
+
+	pthread_mutex_lock(&spool->mutex);
+	if ((long) (seq - spool->acked) > 0) {
+		spool->acked = seq;
+	}
+
+	/* a lost acknowledgement only causes readings to be sent twice,
+	   so we leave syncing to spool_sync() */
+	uint64_t acked = spool->acked;
+	if (pwrite(spool->ackfd, &acked, sizeof(acked), 0) != sizeof(acked)) {
+		print(log_error, "Cannot write to spool %s: %s", NULL, spool->path, strerror(errno));
+		ret = ERR;
+	}
+
+	/* remove completely acknowledged segments, except the one we are appending to */
+	while (spool->count > 1 && (long) (spool->acked - spool->segments[1]) >= 0) {
+		spool_drop(spool);
+	}
+	pthread_mutex_unlock(&spool->mutex);
+
+	return ret;
+}
@@ -24,10 +24,12 @@
  */
 
 #include <math.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "reading.h"
 #include "api.h"
+#include "upload.h"
 #include "vzlogger.h"
 #include "threads.h"
 
@@ -80,43 +82,61 @@ void * reading_thread(void *arg) {
 		}
 
 		/* insert readings into channel queues */
-		foreach(mapping->channels, ch, channel_t) {
-			buffer_t *buf = &ch->buffer;
-			reading_t *add = NULL;
+		for (int i = 0; i < n; i++) {
+			size_t count;
+			channel_t **chs = dispatch_lookup(&mapping->dispatch, rds[i].identifier, &count);
 
-			for (int i = 0; i < n; i++) {
-				if (reading_id_compare(mtr->protocol, rds[i].identifier, ch->identifier) == 0) {
-					if (tvtod(ch->last.time) < tvtod(rds[i].time)) {
-						ch->last = rds[i];
-					}
+			for (size_t j = 0; j < count; j++) {
+				channel_t *ch = chs[j];
 
-					print(log_info, "Adding reading to queue (value=%.2f ts=%.3f)", ch, rds[i].value, tvtod(rds[i].time));
-					reading_t *rd = buffer_push(&ch->buffer, &rds[i]);
+				if (tvtod(ch->last.time) < tvtod(rds[i].time)) {
+					ch->last = rds[i];
+				}
 
-					if (add == NULL) {
-						add = rd; /* remember first reading which has been added to the buffer */
+				print(log_info, "Adding reading to queue (value=%.2f ts=%.3f)", ch, rds[i].value, tvtod(rds[i].time));
+				unsigned long seq = ch->buffer.tail;
+				if (buffer_push(&ch->buffer, &rds[i]) == NULL) {
+					print(log_error, "cannot allocate buffer", ch);
+				}
+				else {
+					aggregate_push(&ch->aggregate, &rds[i]);
+
+					if (ch->spool) {
+						spool_append(ch->spool, seq, &rds[i]);
 					}
+
+					/* invalidate ETags of the local interface */
+					__atomic_add_fetch(&ch->version, 1, __ATOMIC_RELEASE);
 				}
 			}
+		}
 
-			/* update buffer length */
+		foreach(mapping->channels, ch, channel_t) {
+			buffer_t *buf = &ch->buffer;
+
+			if (ch->spool) {
+				spool_sync(ch->spool);
+			}
+
+			/* update buffer length and running aggregates */
 			if (options.local) {
 				buf->keep = (mtr->interval > 0) ? ceil(options.buffer_length / mtr->interval) : 0;
+
+				if (aggregate_reserve(&ch->aggregate, buf->keep + 1) != SUCCESS) {
+					print(log_error, "cannot allocate aggregates", ch);
+				}
 			}
 
-			/* queue reading into sending buffer logging thread if
-			   logging is enabled & sent queue is empty */
-			if (options.logging && buf->sent == NULL) {
-				buf->sent = add;
+			/* resize ring for local interface and offline buffering */
+			if (buffer_reserve(buf, buf->keep + options.buffer_headroom) != SUCCESS) {
+				print(log_error, "cannot allocate buffer", ch);
 			}
 
 			/* shrink buffer */
 			buffer_clean(buf);
 
 			/* notify webserver and logging thread */
-			pthread_mutex_lock(&buf->mutex);
-			pthread_cond_broadcast(&ch->condition);
-			pthread_mutex_unlock(&buf->mutex);
+			buffer_notify(buf);
 
 			/* debugging */
 			if (options.verbosity >= log_debug) {
@@ -133,7 +153,8 @@ void * reading_thread(void *arg) {
 					dump = malloc(dump_len);
 				}
 
-				print(log_debug, "Buffer dump (size=%i keep=%i): %s", ch, buf->size, buf->keep, dump);
+				print(log_debug, "Buffer dump (size=%zu keep=%i capacity=%zu spilled=%lu overwritten=%lu): %s", ch,
+					buffer_size(buf), buf->keep, (buf->ring) ? buf->ring->capacity : 0, buf->spilled, buf->overwritten, dump);
 
 				free(dump);
 			}
@@ -150,83 +171,56 @@ void * reading_thread(void *arg) {
 	return NULL;
 }
 
-void logging_thread_cleanup(void *arg) {
-	api_handle_t *api = (api_handle_t *) arg;
-
-	api_free(api);
-}
-
 void * logging_thread(void *arg) {
-	channel_t *ch = (channel_t *) arg; /* casting argument */
-	api_handle_t api;
-
-	if (api_init(ch, &api) != SUCCESS) {
-		print(log_error, "CURL: cannot create handle", ch);
-		exit(EXIT_FAILURE);
-	}
-
-	pthread_cleanup_push(&logging_thread_cleanup, &api);
-
-	do { /* start thread mainloop */
-		CURLresponse response;
-		json_object *json_obj;
-
-		const char *json_str;
-		long int http_code, curl_code;
-
-		/* initialize response */
-		response.data = NULL;
-		response.size = 0;
-
-		pthread_mutex_lock(&ch->buffer.mutex);
-		while (ch->buffer.sent == NULL) { /* detect spurious wakeups */
-			pthread_cond_wait(&ch->condition, &ch->buffer.mutex); /* sleep until new data has been read */
+	upload_engine_t *engine = (upload_engine_t *) arg; /* casting argument */
+	time_t deadline = 0;
+
+	while (TRUE) { /* start thread mainloop */
+		int timeout = 1000; /* in milliseconds; wake up periodically to check for expired retry pauses */
+		int finished = FALSE, done = TRUE;
+		int running, queued, started;
+		CURLMsg *msg;
+
+		if (engine->shutdown && deadline == 0) { /* final flush of all pending readings, ignoring batch limits */
+			print(log_info, "Flushing pending readings", NULL);
+			deadline = time(NULL) + UPLOAD_SHUTDOWN_TIMEOUT;
 		}
-		pthread_mutex_unlock(&ch->buffer.mutex);
 
-		reading_t *first = ch->buffer.sent;
-		reading_t *last = ch->buffer.tail;
-		json_obj = api_json_tuples(&ch->buffer, first, last);
-		json_str = json_object_to_json_string(json_obj);
+		/* start requests for channels with pending readings, arm notifications for the others */
+		started = upload_schedule(engine, &timeout);
 
-		print(log_debug, "JSON request body: %s", ch, json_str);
+		if (engine->shutdown && ((!started && !upload_busy(engine)) || time(NULL) >= deadline)) {
+			break;
+		}
 
-		curl_easy_setopt(api.curl, CURLOPT_POSTFIELDS, json_str);
-		curl_easy_setopt(api.curl, CURLOPT_WRITEFUNCTION, curl_custom_write_callback);
-		curl_easy_setopt(api.curl, CURLOPT_WRITEDATA, (void *) &response);
+		curl_multi_perform(engine->multi, &running);
 
-		curl_code = curl_easy_perform(api.curl);
-		curl_easy_getinfo(api.curl, CURLINFO_RESPONSE_CODE, &http_code);
+		while ((msg = curl_multi_info_read(engine->multi, &queued))) {
+			if (msg->msg == CURLMSG_DONE) {
+				upload_t *up;
 
-		/* check response */
-		if (curl_code != CURLE_OK) {
-			print(log_error, "CURL: %s", ch, curl_easy_strerror(curl_code));
-		}
-		else if (http_code != 200) {
-			char exception[255];
-			if (api_parse_exception(response, exception, 255) == SUCCESS) {
-				print(log_error, "Request failed: [%i] %s", ch, http_code, exception);
-			}
-			else {
-				print(log_error, "Request failed: %i", ch, http_code);
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &up);
+				upload_finish(engine, up, msg->data.result);
+				finished = TRUE;
 			}
 		}
-		else {
-			print(log_debug, "Request succeeded: %i", ch, http_code);
-			ch->buffer.sent = last->next;
-		}
 
-		/* householding */
-		free(response.data);
-		json_object_put(json_obj);
+		/* without daemon mode every channel sends a single request */
+		for (size_t i = 0; i < engine->count; i++) {
+			if (engine->uploads[i].requests == 0) {
+				done = FALSE;
+			}
+		}
 
-		if (options.daemon && (curl_code != CURLE_OK || http_code != 200)) {
-			print(log_info, "Waiting %i secs for next request due to previous failure", ch, options.retry_pause);
-			sleep(options.retry_pause);
+		if (!options.daemon && done) {
+			break;
 		}
-	} while (options.daemon);
 
-	pthread_cleanup_pop(1);
+		if (!finished) {
+			/* sleep until new readings arrive or requests make progress */
+			upload_wait(engine, timeout);
+		}
+	}
 
 	return NULL;
 }
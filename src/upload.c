@@ -0,0 +1,692 @@
+/**
+ * Event-driven upload of readings to the middleware
+ *
+ * @author Steffen Vogel <info@steffenvogel.de>
+ * @copyright Copyright (c) 2011, The volkszaehler.org project
+ * @package vzlogger
+ * @license http://opensource.org/licenses/gpl-license.php GNU Public License
+ */
+/*
+ * This file is part of volkzaehler.org
+ *
+ * volkzaehler.org is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * volkzaehler.org is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with volkszaehler.org. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "upload.h"
+#include "vzlogger.h"
+#include "spool.h"
+
+extern config_options_t options;
+
+/**
+ * Current time in milliseconds
+ */
+static long long upload_now() {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int upload_handle_init(upload_t *up, channel_t *ch, channel_sink_t *sink, upload_middleware_t *mw) {
+	up->ch = ch;
+	up->sink = sink;
+	up->middleware = mw;
+	up->busy = FALSE;
+	up->retry = 0;
+	up->rejected = FALSE;
+	up->pending = 0;
+	up->requests = 0;
+
+	int ret = (ch) ? api_init(ch, mw->url, &up->api) : api_init_middleware(mw->url, &up->api);
+	if (ret != SUCCESS) {
+		print(log_error, "CURL: cannot create handle", ch);
+		return ERR;
+	}
+
+	curl_easy_setopt(up->api.curl, CURLOPT_PRIVATE, (void *) up);
+
+	return SUCCESS;
+}
+
+static void upload_handle_free(upload_engine_t *engine, upload_t *up) {
+	if (up->busy) {
+		curl_multi_remove_handle(engine->multi, up->api.curl);
+	}
+
+	api_free(&up->api);
+}
+
+int upload_init(upload_engine_t *engine, list_t *mappings) {
+	size_t i = 0;
+
+	engine->count = 0;
+	engine->nmiddlewares = 0;
+	engine->shutdown = FALSE;
+	engine->seed = time(NULL) ^ getpid();
+	foreach(*mappings, mapping, map_t) {
+		foreach(mapping->channels, ch, channel_t) {
+			engine->count += ch->nsinks;
+		}
+	}
+
+	engine->uploads = malloc(engine->count * sizeof(upload_t));
+	engine->middlewares = malloc(engine->count * sizeof(upload_middleware_t));
+	engine->multi = curl_multi_init();
+
+	if (engine->uploads == NULL || engine->middlewares == NULL || engine->multi == NULL || pipe(engine->notify) != 0) {
+		print(log_error, "Cannot initialize upload engine", NULL);
+		return ERR;
+	}
+
+	/* neither the reading threads nor the engine may block on the pipe */
+	for (int j = 0; j < 2; j++) {
+		fcntl(engine->notify[j], F_SETFL, O_NONBLOCK);
+		fcntl(engine->notify[j], F_SETFD, FD_CLOEXEC);
+	}
+
+	/* limit number of concurrent connections to the same middleware */
+	curl_multi_setopt(engine->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) options.connections);
+
+	foreach(*mappings, mapping, map_t) {
+		foreach(mapping->channels, ch, channel_t) {
+			for (size_t k = 0; k < ch->nsinks; k++) {
+				channel_sink_t *sink = &ch->sinks[k];
+				upload_t *up = &engine->uploads[i++];
+				upload_middleware_t *mw = NULL;
+
+				/* group channels by middleware */
+				for (size_t j = 0; j < engine->nmiddlewares; j++) {
+					if (strcmp(engine->middlewares[j].url, sink->middleware) == 0) {
+						mw = &engine->middlewares[j];
+						break;
+					}
+				}
+
+				if (mw == NULL) {
+					mw = &engine->middlewares[engine->nmiddlewares++];
+
+					mw->url = sink->middleware;
+					mw->coalesce = options.coalesce;
+					mw->fallback = 0;
+					mw->pending = 0;
+					mw->circuit = UPLOAD_CLOSED;
+					mw->failures = 0;
+					mw->retry = 0;
+					mw->probe = NULL;
+					mw->channels = malloc(engine->count * sizeof(upload_t *));
+					mw->count = 0;
+
+					if (upload_handle_init(&mw->request, NULL, NULL, mw) != SUCCESS) {
+						return ERR;
+					}
+				}
+
+				mw->channels[mw->count++] = up;
+
+				if (upload_handle_init(up, ch, sink, mw) != SUCCESS) {
+					return ERR;
+				}
+
+				up->sink->cursor->fd = engine->notify[1];
+			}
+		}
+	}
+
+	return SUCCESS;
+}
+
+void upload_free(upload_engine_t *engine) {
+	for (size_t i = 0; i < engine->count; i++) {
+		engine->uploads[i].sink->cursor->fd = -1;
+		upload_handle_free(engine, &engine->uploads[i]);
+	}
+
+	for (size_t i = 0; i < engine->nmiddlewares; i++) {
+		upload_handle_free(engine, &engine->middlewares[i].request);
+		free(engine->middlewares[i].channels);
+	}
+
+	curl_multi_cleanup(engine->multi);
+	close(engine->notify[0]);
+	close(engine->notify[1]);
+	free(engine->uploads);
+	free(engine->middlewares);
+}
+
+/**
+ * Encode pending readings of a channel as JSON array of tuples
+ *
+ * Backlogs are drained in chunks: encoding stops at max tuples or
+ * once the body has reached options.chunk_bytes.
+ *
+ * @param max maximum number of tuples
+ * @return the number of encoded tuples; up->last is set after the last one
+ */
+static size_t upload_encode(upload_t *up, api_buffer_t *body, size_t max) {
+	channel_t *ch = up->ch;
+	unsigned long first = up->sink->cursor->seq;
+	unsigned long tail = buffer_tail(&ch->buffer);
+	unsigned long spill_head = __atomic_load_n(&ch->buffer.spill_head, __ATOMIC_ACQUIRE);
+
+	if (ch->spool && (long) (spill_head - first) > 0) {
+		/* drain readings from spool which are not in the buffer anymore */
+		reading_t rds[API_SPOOL_CHUNK_SIZE];
+
+		size_t count = (body->length < options.chunk_bytes) ? (options.chunk_bytes - body->length) / API_TUPLE_LENGTH + 1 : 1;
+
+		if (count > max) {
+			count = max;
+		}
+
+		if (count > API_SPOOL_CHUNK_SIZE) {
+			count = API_SPOOL_CHUNK_SIZE;
+		}
+
+		up->last = first;
+		size_t n = spool_read(ch->spool, &up->last, spill_head, rds, count);
+
+		if (n == 0) {
+			if (up->last == first) { /* the spool lags behind the buffer */
+				print(log_warning, "Lost %lu readings which have not been spooled", ch, spill_head - first);
+				up->last = spill_head;
+			}
+
+			channel_ack(ch, up->sink, up->last); /* skip corrupted, dropped or lost records */
+			return 0;
+		}
+
+		api_json_readings(body, rds, n);
+
+		return n;
+	}
+	else if (tail != first) {
+		if (tail - first > max) {
+			tail = first + max;
+		}
+
+		up->last = api_json_tuples(body, &ch->buffer, first, tail, options.chunk_bytes);
+
+		return up->last - first;
+	}
+
+	return 0; /* nothing to send */
+}
+
+/**
+ * Start a request for the pending readings of a channel
+ *
+ * @return TRUE if a request has been started
+ */
+static int upload_start(upload_engine_t *engine, upload_t *up) {
+	api_buffer_clear(&up->api.body);
+
+	if (upload_encode(up, &up->api.body, options.chunk_tuples) == 0) {
+		return FALSE;
+	}
+
+	print(log_debug, "JSON request body: %s", up->ch, up->api.body.data);
+
+	/* remaining chunks of a backlog stay due */
+	if (up->last == buffer_tail(&up->ch->buffer)) {
+		up->pending = 0;
+	}
+
+	api_prepare(&up->api, up->ch);
+
+	up->busy = TRUE;
+	curl_multi_add_handle(engine->multi, up->api.curl);
+
+	return TRUE;
+}
+
+/**
+ * Start a coalesced request for the pending readings of all channels of a middleware
+ *
+ * Body: [{"uuid":"...","tuples":[[ts,value],...]},...]
+ *
+ * @return TRUE if a request has been started
+ */
+static int upload_start_coalesced(upload_engine_t *engine, upload_middleware_t *mw) {
+	upload_t *req = &mw->request;
+	api_buffer_t *body = &req->api.body;
+	size_t total = 0;
+	size_t max = (options.coalesce_tuples < options.chunk_tuples) ? options.coalesce_tuples : options.chunk_tuples;
+
+	api_buffer_clear(body);
+	api_buffer_append(body, "[", 1);
+
+	for (size_t i = 0; i < mw->count && total < max && body->length < options.chunk_bytes; i++) {
+		upload_t *up = mw->channels[i];
+		size_t length = body->length;
+
+		if (up->rejected || up->busy) { /* sent by single requests */
+			continue;
+		}
+
+		api_buffer_append(body, (total) ? ",{\"uuid\":" : "{\"uuid\":", (total) ? 9 : 8);
+		api_json_string(body, up->ch->uuid);
+		api_buffer_append(body, ",\"tuples\":", 10);
+
+		size_t n = upload_encode(up, body, max - total);
+		if (n == 0) { /* revert envelope */
+			body->length = length;
+			body->data[length] = '\0';
+			continue;
+		}
+
+		api_buffer_append(body, "}", 1);
+
+		up->busy = TRUE; /* part of the coalesced request */
+		if (up->last == buffer_tail(&up->ch->buffer)) {
+			up->pending = 0;
+		}
+		total += n;
+	}
+
+	api_buffer_append(body, "]", 1);
+
+	if (total == 0) {
+		return FALSE;
+	}
+
+	print(log_debug, "JSON request body: %s", NULL, body->data);
+
+	api_prepare(&req->api, NULL);
+
+	req->busy = TRUE;
+	curl_multi_add_handle(engine->multi, req->api.curl);
+
+	return TRUE;
+}
+
+/**
+ * Check if the pending readings of a channel have to be flushed
+ *
+ * Readings are accumulated until batch_max_tuples are pending or the oldest
+ * has been pending for batch_max_delay seconds. On shutdown everything is due.
+ *
+ * @param timeout in milliseconds; gets lowered to the time until the channel is due
+ */
+static int upload_due(upload_engine_t *engine, upload_t *up, long long now, int *timeout) {
+	channel_t *ch = up->ch;
+	size_t pending = buffer_tail(&ch->buffer) - up->sink->cursor->seq;
+
+	if (up->pending == 0) {
+		up->pending = now;
+	}
+
+	if (engine->shutdown || pending >= ch->batch_max_tuples) {
+		return TRUE;
+	}
+
+	long long remaining = up->pending + ch->batch_max_delay * 1000LL - now;
+	if (remaining <= 0) {
+		return TRUE;
+	}
+
+	if (remaining < *timeout) {
+		*timeout = remaining;
+	}
+
+	/* wake up on further readings to check batch_max_tuples */
+	__atomic_store_n(&up->sink->cursor->waiting, 1, __ATOMIC_SEQ_CST);
+
+	return FALSE;
+}
+
+/**
+ * Check the circuit breaker of a middleware before starting requests
+ *
+ * @return the number of requests which may be started, -1 for unlimited
+ */
+static int upload_circuit(upload_middleware_t *mw, long long now, int *timeout) {
+	switch (mw->circuit) {
+		case UPLOAD_CLOSED:
+			return -1;
+
+		case UPLOAD_OPEN:
+			if (mw->retry > now) {
+				if (mw->retry - now < *timeout) {
+					*timeout = mw->retry - now;
+				}
+
+				return 0;
+			}
+
+			print(log_info, "Probing middleware %s", NULL, mw->url);
+			mw->circuit = UPLOAD_HALF_OPEN;
+			/* fall through */
+
+		case UPLOAD_HALF_OPEN:
+			return (mw->probe) ? 0 : 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Open the circuit breaker of a middleware after a failure
+ *
+ * The backoff doubles with every consecutive failure and is randomized
+ * to spread the reconnects of multiple loggers.
+ */
+static void upload_circuit_open(upload_engine_t *engine, upload_middleware_t *mw) {
+	long long backoff = options.retry_pause * 1000LL;
+	long long max = options.retry_max * 1000LL;
+
+	for (int i = 0; i < mw->failures && backoff < max; i++) {
+		backoff *= 2;
+	}
+
+	if (backoff > max) {
+		backoff = max;
+	}
+
+	/* equal jitter: between half and full backoff */
+	backoff = backoff / 2 + rand_r(&engine->seed) % (backoff / 2 + 1);
+
+	mw->failures++;
+	mw->circuit = UPLOAD_OPEN;
+	mw->retry = upload_now() + backoff;
+
+	print(log_info, "Middleware %s is unavailable (%i failures), next attempt in %lli ms", NULL, mw->url, mw->failures, backoff);
+}
+
+/**
+ * Start a coalesced request if the readings of a middleware are due
+ *
+ * @return TRUE if a request has been started
+ */
+static int upload_schedule_coalesced(upload_engine_t *engine, upload_middleware_t *mw, long long ms, int *timeout) {
+	size_t pending = 0;
+	int due = FALSE;
+
+	if (mw->request.busy) {
+		return FALSE;
+	}
+
+	/* arm notifications of idle channels and count pending readings */
+	for (size_t j = 0; j < mw->count; j++) {
+		upload_t *up = mw->channels[j];
+
+		if (up->rejected || up->busy) {
+			continue;
+		}
+
+		if (buffer_poll(&up->ch->buffer, up->sink->cursor)) {
+			pending += buffer_tail(&up->ch->buffer) - up->sink->cursor->seq;
+			due |= upload_due(engine, up, ms, timeout);
+		}
+		else {
+			up->pending = 0;
+		}
+	}
+
+	if (!due) {
+		mw->pending = 0;
+		return FALSE;
+	}
+
+	if (mw->pending == 0) {
+		mw->pending = ms;
+	}
+
+	/* wait for more readings of other channels */
+	long long remaining = mw->pending + options.coalesce_delay - ms;
+	if (pending < options.coalesce_tuples && remaining > 0 && !engine->shutdown) {
+		if (remaining < *timeout) {
+			*timeout = remaining;
+		}
+
+		return FALSE;
+	}
+
+	if (upload_start_coalesced(engine, mw)) {
+		if (mw->circuit == UPLOAD_HALF_OPEN) {
+			mw->probe = &mw->request;
+		}
+
+		mw->pending = 0;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Start a request if the readings of a channel are due
+ *
+ * @return TRUE if a request has been started
+ */
+static int upload_schedule_single(upload_engine_t *engine, upload_t *up, long long ms, int *timeout) {
+	upload_middleware_t *mw = up->middleware;
+
+	if (!buffer_poll(&up->ch->buffer, up->sink->cursor)) {
+		up->pending = 0;
+		return FALSE;
+	}
+
+	while (upload_due(engine, up, ms, timeout)) {
+		unsigned long seq = up->sink->cursor->seq;
+
+		if (upload_start(engine, up)) {
+			if (mw->circuit == UPLOAD_HALF_OPEN) {
+				mw->probe = up;
+			}
+
+			return TRUE;
+		}
+		else if (up->sink->cursor->seq == seq || !buffer_poll(&up->ch->buffer, up->sink->cursor)) {
+			/* dropped spool records only, or no progress at all */
+			up->pending = 0;
+			break;
+		}
+	}
+
+	return FALSE;
+}
+
+int upload_schedule(upload_engine_t *engine, int *timeout) {
+	time_t now = time(NULL);
+	long long ms = upload_now();
+	int started = 0;
+
+	for (size_t i = 0; i < engine->nmiddlewares; i++) {
+		upload_middleware_t *mw = &engine->middlewares[i];
+		int allowed = upload_circuit(mw, ms, timeout);
+		int coalesce = mw->coalesce && mw->fallback <= now;
+
+		if (allowed == 0) {
+			continue;
+		}
+
+		if (coalesce && upload_schedule_coalesced(engine, mw, ms, timeout)) {
+			allowed--;
+			started++;
+		}
+
+		/* channels which are not part of coalesced requests */
+		for (size_t j = 0; j < mw->count && allowed != 0; j++) {
+			upload_t *up = mw->channels[j];
+
+			if ((coalesce && !up->rejected) || up->busy || up->retry > now) {
+				continue;
+			}
+
+			if (upload_schedule_single(engine, up, ms, timeout)) {
+				allowed--;
+				started++;
+			}
+		}
+	}
+
+	return started;
+}
+
+/**
+ * Check response of a request
+ *
+ * @param rejected set to TRUE if the middleware answered with a client error
+ * @return TRUE on success
+ */
+static int upload_check(upload_t *up, CURLcode result, int *rejected, int *reachable) {
+	void *id = (up->ch) ? (void *) up->ch : NULL;
+	long int http_code = 0;
+
+	curl_easy_getinfo(up->api.curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+	*rejected = FALSE;
+	*reachable = (result == CURLE_OK && http_code < 500);
+
+	if (result != CURLE_OK) {
+		print(log_error, "CURL: %s", id, curl_easy_strerror(result));
+	}
+	else if (http_code != 200) {
+		char exception[255];
+		if (api_parse_exception(&up->api.response, exception, 255) == SUCCESS) {
+			print(log_error, "Request failed: [%i] %s", id, http_code, exception);
+		}
+		else {
+			print(log_error, "Request failed: %i", id, http_code);
+		}
+
+		*rejected = *reachable;
+	}
+	else {
+		print(log_debug, "Request succeeded: %i", id, http_code);
+	}
+
+	/* householding */
+	api_buffer_clear(&up->api.response);
+
+	return (result == CURLE_OK && http_code == 200);
+}
+
+/**
+ * Mark readings of a successful request as sent
+ */
+static void upload_ack(upload_t *up) {
+	channel_ack(up->ch, up->sink, up->last);
+}
+
+void upload_finish(upload_engine_t *engine, upload_t *up, CURLcode result) {
+	upload_middleware_t *mw = up->middleware;
+	int rejected, reachable, success, pause;
+
+	curl_multi_remove_handle(engine->multi, up->api.curl);
+	success = upload_check(up, result, &rejected, &reachable);
+	pause = rejected;
+
+	if (mw->probe == up) {
+		mw->probe = NULL;
+	}
+
+	if (reachable) {
+		if (mw->circuit != UPLOAD_CLOSED) {
+			print(log_info, "Middleware %s is available again", NULL, mw->url);
+		}
+
+		mw->circuit = UPLOAD_CLOSED;
+		mw->failures = 0;
+	}
+	else if (options.daemon && mw->circuit != UPLOAD_OPEN) { /* count concurrent failures only once */
+		upload_circuit_open(engine, mw);
+	}
+
+	if (up->ch == NULL) { /* coalesced request */
+		for (size_t i = 0; i < mw->count; i++) {
+			upload_t *ch_up = mw->channels[i];
+
+			if (ch_up->busy) {
+				if (success) {
+					upload_ack(ch_up);
+				}
+
+				ch_up->busy = FALSE;
+				ch_up->requests++;
+			}
+		}
+
+		if (rejected) { /* e.g. a channel with an unknown UUID; single requests tell which one */
+			print(log_error, "Middleware %s rejected coalesced request, falling back to single requests for %i secs",
+				NULL, mw->url, options.retry_max);
+			mw->fallback = time(NULL) + options.retry_max;
+			pause = FALSE; /* retry immediately with single requests */
+		}
+	}
+	else if (success) {
+		upload_ack(up);
+		up->rejected = FALSE;
+	}
+	else if (rejected) { /* keep the channel out of coalesced requests */
+		up->rejected = TRUE;
+	}
+
+	if (options.daemon && pause) { /* channel specific error, the middleware itself is healthy */
+		print(log_info, "Waiting %i secs for next request due to previous failure", up->ch, options.retry_pause);
+		up->retry = time(NULL) + options.retry_pause;
+	}
+
+	up->busy = FALSE;
+	up->requests++;
+}
+
+void upload_shutdown(upload_engine_t *engine) {
+	if (engine->multi == NULL) { /* not initialized yet */
+		return;
+	}
+
+	engine->shutdown = TRUE;
+
+	if (write(engine->notify[1], "", 1) < 0) {
+		/* pipe is full, the engine will wake up anyway */
+	}
+}
+
+int upload_busy(upload_engine_t *engine) {
+	for (size_t i = 0; i < engine->nmiddlewares; i++) {
+		if (engine->middlewares[i].request.busy) {
+			return TRUE;
+		}
+	}
+
+	for (size_t i = 0; i < engine->count; i++) {
+		if (engine->uploads[i].busy) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+void upload_wait(upload_engine_t *engine, int timeout) {
+	struct curl_waitfd extra = {
+		.fd = engine->notify[0],
+		.events = CURL_WAIT_POLLIN
+	};
+	char drain[64];
+
+	curl_multi_wait(engine->multi, &extra, 1, timeout, NULL);
+
+	/* consume notifications */
+	while (read(engine->notify[0], drain, sizeof(drain)) > 0);
+}
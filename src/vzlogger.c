@@ -44,13 +44,21 @@
 #include "vzlogger.h"
 #include "channel.h"
 #include "threads.h"
+#include "upload.h"
 
 #ifdef LOCAL_SUPPORT
 #include "local.h"
 #endif /* LOCAL_SUPPORT */
 
 list_t mappings;	/* mapping between meters and channels */
+channel_index_t uuids;	/* channels by UUID */
 config_options_t options;	/* global application options */
+pthread_t uploader;	/* single thread uploading the readings of all channels */
+upload_engine_t uploads;	/* upload state of all channels */
+
+#ifdef LOCAL_SUPPORT
+local_t local;		/* HTTPd & snapshots of the local interface */
+#endif /* LOCAL_SUPPORT */
 
 /**
  * Command line options
@@ -229,10 +237,10 @@ void quit(int sig) {
 
 	foreach(mappings, mapping, map_t) {
 		pthread_cancel(mapping->thread);
+	}
 
-		foreach(mapping->channels, ch, channel_t) {
-			pthread_cancel(ch->thread);
-		}
+	if (options.logging) {
+		upload_shutdown(&uploads); /* flush pending readings before terminating */
 	}
 }
 
@@ -311,10 +319,32 @@ int main(int argc, char *argv[]) {
 	options.log = NULL;
 	options.logfd = NULL;
 	options.port = 8080;
+	options.local_threads = 2;
 	options.verbosity = 0;
 	options.comet_timeout = 30;
 	options.buffer_length = 600;
 	options.retry_pause = 15;
+	options.retry_max = 600;
+	options.connections = 4;
+	options.batch_max_tuples = 1;
+	options.batch_max_delay = 0;
+	options.compress = FALSE;
+	options.compress_level = 6;
+	options.compress_threshold = 1024;
+	options.chunk_tuples = 10000;
+	options.chunk_bytes = 1024 * 1024;
+	options.coalesce = FALSE;
+	options.coalesce_tuples = 4096;
+	options.coalesce_delay = 1000;
+	options.buffer_headroom = 1024;
+	options.memory_channel = 0;
+	options.memory_total = 0;
+	options.spill = NULL;
+	options.spill_size = 16 * 1024 * 1024;
+	options.memory_compress = FALSE;
+	options.spool = NULL;
+	options.spool_max = 64 * 1024 * 1024;
+	options.spool_sync = 10;
 	options.daemon = FALSE;
 	options.local = FALSE;
 	options.logging = TRUE;
@@ -339,7 +369,7 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
-	if (config_parse(options.config, &mappings, &options) != SUCCESS) {
+	if (config_parse(options.config, &mappings, &uuids, &options) != SUCCESS) {
 		return EXIT_FAILURE;
 	}
 
@@ -368,6 +398,66 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
+	/* register consumers, apply memory budget & enable spill tier */
+	size_t channels = 0;
+	foreach(mappings, mapping, map_t) {
+		channels += mapping->channels.size;
+	}
+
+	foreach(mappings, mapping, map_t) {
+		foreach(mapping->channels, ch, channel_t) {
+			/* the logging thread holds back readings until they have been sent to all sinks */
+			if (options.logging) {
+				for (size_t i = 0; i < ch->nsinks; i++) {
+					ch->sinks[i].cursor = buffer_cursor(&ch->buffer, TRUE);
+				}
+			}
+
+			/* apply global defaults for upload batching */
+			if (ch->batch_max_tuples == 0) {
+				ch->batch_max_tuples = (options.batch_max_tuples > 0) ? options.batch_max_tuples : 1;
+			}
+
+			if (ch->batch_max_delay < 0) {
+				ch->batch_max_delay = options.batch_max_delay;
+			}
+
+			if (options.local) {
+				ch->local = buffer_cursor(&ch->buffer, FALSE);
+				aggregate_reserve(&ch->aggregate, ch->buffer.keep + 1);
+			}
+
+			ch->buffer.budget = options.memory_channel;
+
+			if (options.memory_total && (ch->buffer.budget == 0 || ch->buffer.budget > options.memory_total / channels)) {
+				ch->buffer.budget = options.memory_total / channels;
+			}
+
+			if (((options.spill && options.logging) || options.memory_compress) &&
+				channel_spill(ch, options.spill, options.spill_size, options.memory_compress) != SUCCESS) {
+				print(log_error, "Failed to create spill file. Aborting.", ch);
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (dispatch_init(&mapping->dispatch, mapping->meter.protocol, &mapping->channels) != SUCCESS) {
+			print(log_error, "Failed to build dispatch table. Aborting.", &mapping->meter);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* open spools & replay unsent readings */
+	if (options.spool && options.logging) {
+		foreach(mappings, mapping, map_t) {
+			foreach(mapping->channels, ch, channel_t) {
+				if (channel_spool(ch, options.spool, options.spool_max, options.spool_sync) != SUCCESS) {
+					print(log_error, "Failed to open spool. Aborting.", ch);
+					return EXIT_FAILURE;
+				}
+			}
+		}
+	}
+
 	/* open connection meters & start threads */
 	foreach(mappings, mapping, map_t) {
 		meter_t *mtr = &mapping->meter;
@@ -388,56 +478,67 @@ int main(int argc, char *argv[]) {
 			if (meter_get_details(mtr->protocol)->periodic && options.local) {
 				ch->buffer.keep = ceil(options.buffer_length / (double) mapping->meter.interval);
 			}
+		}
+	}
 
-			if (options.logging) {
-				pthread_create(&ch->thread, NULL, &logging_thread, (void *) ch);
-				print(log_debug, "Logging thread started", ch);
-			}
+	if (options.logging) {
+		if (upload_init(&uploads, &mappings) != SUCCESS) {
+			print(log_error, "Failed to initialize uploads. Aborting.", NULL);
+			return EXIT_FAILURE;
 		}
+
+		pthread_create(&uploader, NULL, &logging_thread, (void *) &uploads);
+		print(log_debug, "Logging thread started", NULL);
 	}
 
 #ifdef LOCAL_SUPPORT
 	 /* start webserver for local interface */
-	struct MHD_Daemon *httpd_handle = NULL;
 	if (options.local) {
 		print(log_info, "Starting local interface HTTPd on port %i", "http", options.port);
-		httpd_handle = MHD_start_daemon(
-			MHD_USE_THREAD_PER_CONNECTION,
-			options.port,
-			NULL, NULL,
-			&handle_request, &mappings,
-			MHD_OPTION_END
-		);
+		if (local_init(&local, &mappings, &uuids) != SUCCESS) {
+			print(log_error, "Failed to start local interface. Aborting.", "http");
+			return EXIT_FAILURE;
+		}
 	}
 #endif /* LOCAL_SUPPORT */
 
 	/* wait for all threads to terminate */
 	foreach(mappings, mapping, map_t) {
-		meter_t *mtr = &mapping->meter;
-
 		pthread_join(mapping->thread, NULL);
+	}
 
-		foreach(mapping->channels, ch, channel_t) {
-			pthread_join(ch->thread, NULL);
+	if (options.logging) {
+		pthread_join(uploader, NULL);
+		upload_free(&uploads);
+	}
+
+#ifdef LOCAL_SUPPORT
+	/* stop webserver */
+	if (options.local) {
+		local_free(&local);
+	}
+#endif /* LOCAL_SUPPORT */
 
+	foreach(mappings, mapping, map_t) {
+		meter_t *mtr = &mapping->meter;
+
+		foreach(mapping->channels, ch, channel_t) {
 			channel_free(ch);
 		}
 
 		meter_close(mtr); /* closing connection */
 
+		dispatch_free(&mapping->dispatch);
 		list_free(&mapping->channels);
 		meter_free(mtr);
 	}
 
-#ifdef LOCAL_SUPPORT
-	/* stop webserver */
-	if (httpd_handle) {
-		MHD_stop_daemon(httpd_handle);
-	}
-#endif /* LOCAL_SUPPORT */
+	channel_index_free(&uuids);
 
 	/* householding */
 	free(options.config);
+	free(options.spill);
+	free(options.spool);
 	list_free(&mappings);
 	curl_global_cleanup();
 